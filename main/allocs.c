@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mpc.h"
+
+/*
+** Counts allocator calls made while parsing.
+**
+** malloc, calloc and realloc are wrapped at link
+** time (see the makefile) and counted over each
+** parse of a generated Lispy file, and reported
+** per byte of input. It only uses the original
+** API, so it can be built against an older mpc.c
+** to compare.
+**
+** usage: allocs [forms] [rounds]
+*/
+
+static long calls = 0;
+
+void* __real_malloc(size_t n);
+void* __real_calloc(size_t n, size_t m);
+void* __real_realloc(void* p, size_t n);
+
+void* __wrap_malloc(size_t n) { calls++; return __real_malloc(n); }
+void* __wrap_calloc(size_t n, size_t m) { calls++; return __real_calloc(n, m); }
+void* __wrap_realloc(void* p, size_t n) { calls++; return __real_realloc(p, n); }
+
+int main(int argc, char** argv) {
+
+  int forms  = argc > 1 ? atoi(argv[1]) : 1000;
+  int rounds = argc > 2 ? atoi(argv[2]) : 10;
+
+  mpc_parser_t* Number   = mpc_new("number");
+  mpc_parser_t* Integer  = mpc_new("integer");
+  mpc_parser_t* Decimal  = mpc_new("decimal");
+  mpc_parser_t* Symbol   = mpc_new("symbol");
+  mpc_parser_t* Sexpr    = mpc_new("sexpr");
+  mpc_parser_t* Qexpr    = mpc_new("qexpr");
+  mpc_parser_t* Expr     = mpc_new("expr");
+  mpc_parser_t* Lispy    = mpc_new("lispy");
+
+  mpca_lang(MPCA_LANG_DEFAULT,
+    "                                                       \
+    decimal  : /-?[0-9]+\\.[0-9]+/ ;                        \
+    integer  : /-?[0-9]+/ ;                                 \
+    number   : <decimal> | <integer> ;                      \
+    symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%]+/ ;          \
+    sexpr    : '(' <expr>* ')' ;                            \
+    qexpr    : '{' <expr>* '}' ;                            \
+    expr     : <number> | <symbol> | <sexpr> | <qexpr> ;    \
+    lispy    : /^/ <expr>+ /$/ ;                            \
+  ",
+    Decimal, Integer, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+
+  char* input = malloc(forms * 64 + 1);
+  int len = 0;
+  input[0] = '\0';
+  for (int k = 0; k < forms; k++) {
+    len += sprintf(input + len, "(def {x%i} (+ %i 2.5 {a b}))\n", k, k);
+  }
+
+  mpc_result_t r;
+  long total = 0;
+
+  for (int k = 0; k < rounds; k++) {
+    long before = calls;
+    if (!mpc_parse("<allocs>", input, Lispy, &r)) {
+      mpc_err_print(r.error);
+      return 1;
+    }
+    total += calls - before;
+    mpc_ast_delete(r.output);
+  }
+
+  printf("%i bytes, %i rounds\n", len, rounds);
+  printf("%.2f allocator calls per byte\n", (double)total / rounds / len);
+
+  free(input);
+
+  mpc_cleanup(8, Number, Integer, Decimal, Symbol, Sexpr, Qexpr, Expr, Lispy);
+
+  return 0;
+}
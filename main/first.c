@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "mpc.h"
+
+/*
+** Checks for skipping alternatives by their first character.
+**
+** Each case is a parser, an input and whether it
+** should match, run both as built and compiled,
+** since compiling works out the first sets, and
+** both loudly and quietly, since only a quiet
+** parse skips. A parser that skips an alternative
+** it could have taken fails where it should not,
+** and every parse, failed or not, must run the
+** counting apply at the front exactly once.
+**
+** Ranges compare signed chars, so one running from
+** 0x80 up to 'z' covers 'a' where char is signed.
+**
+** usage: first
+*/
+
+static int calls = 0;
+
+static mpc_val_t* count(mpc_val_t* x) {
+  calls++;
+  return x;
+}
+
+static mpc_parser_t* counted(mpc_parser_t* a) {
+  return mpc_and(2, mpcf_snd, mpc_apply(mpc_pass(), count), a, free);
+}
+
+int main(int argc, char** argv) {
+
+  char lo = (char)0x80, hi = (char)0xff;
+  int signed_char = lo < 0;
+
+  struct {
+    mpc_parser_t* p;
+    const char* input;
+    int match;
+  } cases[] = {
+    { counted(mpc_or(2, mpc_range(lo, 'z'), mpc_char('!'))),  "a", signed_char },
+    { counted(mpc_or(2, mpc_range(lo, 'z'), mpc_char('!'))),  "!", 1 },
+    { counted(mpc_or(2, mpc_range(1, hi), mpc_char('!'))),    "a", !signed_char },
+    { counted(mpc_or(2, mpc_range(1, hi), mpc_char('!'))),    "!", 1 },
+    { counted(mpc_many1(mpcf_strfold, mpc_or(2, mpc_range(1, hi), mpc_char('x')))), "a", !signed_char },
+    { counted(mpc_many1(mpcf_strfold, mpc_or(2, mpc_range(1, hi), mpc_char('x')))), "x", 1 },
+  };
+
+  int failed = 0;
+  mpc_result_t r;
+
+  for (int k = 0; k < (int)(sizeof(cases) / sizeof(cases[0])); k++) {
+
+    mpc_optimise(cases[k].p);
+    mpc_parser_t* ps[2] = { cases[k].p, mpc_compile(cases[k].p) };
+
+    for (int j = 0; j < 4; j++) {
+
+      calls = 0;
+      int ok = j % 2
+        ? mpc_parse_quiet("<first>", cases[k].input, ps[j / 2], &r)
+        : mpc_parse("<first>", cases[k].input, ps[j / 2], &r);
+      if (ok) { free(r.output); } else { mpc_err_delete(r.error); }
+
+      if (ok != cases[k].match || calls != 1) {
+        printf("Case %i%s%s: '%s' gave %i with %i calls, expected %i!\n",
+          k, j / 2 ? " compiled" : "", j % 2 ? " quiet" : "", cases[k].input, ok, calls, cases[k].match);
+        failed = 1;
+      }
+    }
+
+    mpc_delete(ps[0]);
+    mpc_delete(ps[1]);
+  }
+
+  if (!failed) { printf("ok\n"); }
+  return failed;
+}
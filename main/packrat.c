@@ -0,0 +1,79 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "mpc.h"
+
+/*
+** Benchmark for packrat parsing.
+**
+** The grammar below has two alternatives that
+** share the prefix 'a' <s>, so on input like
+** aaaxccc every level parses the whole rest of
+** the input twice and the time doubles with each
+** extra 'a'. Memoizing the rules with
+** MPCA_LANG_PACKRAT makes the parse linear again.
+**
+** A memo hit hands back the AST it stored shared
+** rather than copied, though here each one holds
+** the rest of the input, and the memo table grows
+** with the input. So the packrat time per input
+** character should stay flat as n doubles.
+**
+** usage: packrat [max n without packrat] [max n with packrat]
+*/
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static double run(int flags, int n) {
+
+  mpc_parser_t* S = mpc_new("s");
+  mpc_parser_t* T = mpc_new("t");
+
+  mpca_lang(flags | MPCA_LANG_WHITESPACE_SENSITIVE,
+    " s : 'a' <s> 'b' | 'a' <s> 'c' | 'x' ; t : /^/ <s> /$/ ; ", S, T, NULL);
+
+  char* input = malloc(2 * n + 2);
+  for (int k = 0; k < n; k++) { input[k] = 'a'; }
+  input[n] = 'x';
+  for (int k = 0; k < n; k++) { input[n+1+k] = 'c'; }
+  input[2*n+1] = '\0';
+
+  mpc_result_t r;
+  double t0 = now();
+  if (mpc_parse("<packrat>", input, T, &r)) {
+    mpc_ast_delete(r.output);
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+  }
+  double t1 = now();
+
+  free(input);
+  mpc_cleanup(2, S, T);
+
+  return t1 - t0;
+}
+
+int main(int argc, char** argv) {
+
+  int max = argc > 1 ? atoi(argv[1]) : 20;
+  int big = argc > 2 ? atoi(argv[2]) : 64000;
+
+  printf("%6s %12s %12s\n", "n", "default(s)", "packrat(s)");
+  for (int n = 4; n <= max; n += 4) {
+    printf("%6i %12.4f %12.4f\n", n, run(MPCA_LANG_DEFAULT, n), run(MPCA_LANG_PACKRAT, n));
+  }
+  printf("\n%6s %12s %12s\n", "n", "packrat(s)", "per char(us)");
+  for (int n = 250; n <= big; n *= 2) {
+    double t = run(MPCA_LANG_PACKRAT, n);
+    printf("%6i %12.4f %12.4f\n", n, t, t / (2 * n + 1) * 1e6);
+  }
+
+  return 0;
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include "mpc.h"
 
 /* Windows */
@@ -710,6 +711,66 @@ int most_leaves_in_branch(mpc_ast_t* t) {
   return 0;
 }
 
+/* LOADING */
+
+/* Keep every line of a file as its own child so each is evaluated alone */
+/* Blank lines come through as NULL and are dropped                       */
+mpc_val_t* fold_lines(int n, mpc_val_t** xs) {
+  mpc_ast_t* r = mpc_ast_new(">", "");
+  for (int i = 0; i < n; i++) {
+    if (xs[i]) { mpc_ast_add_child(r, xs[i]); }
+  }
+  return r;
+}
+
+/* Parse a whole file, cut between lines, on every core, then evaluate it in order */
+void load_file(lenv* e, mpc_parser_t* p, char* filename) {
+
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) {
+    printf("Could not open file '%s'\n", filename);
+    return;
+  }
+
+  fseek(f, 0, SEEK_END);
+  long length = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  /* The parser counts in ints, so longer files cannot be loaded */
+  if (length < 0 || length > INT_MAX - 2) {
+    printf("Could not read file '%s'\n", filename);
+    fclose(f);
+    return;
+  }
+
+  char* input = malloc(length + 2);
+  length = fread(input, 1, length, f);
+  fclose(f);
+
+  /* Every line must end in a newline, so give the last one its own */
+  if (length > 0 && input[length-1] != '\n') { input[length++] = '\n'; }
+  input[length] = '\0';
+
+  mpc_result_t r;
+  if (mpc_parse_parallel(filename, input, (int)length, "(){}", 0, p,
+                         mpcf_fold_ast, (mpc_dtor_t)mpc_ast_delete, &r)) {
+
+    mpc_ast_t* t = r.output;
+    for (int i = 0; i < t->children_num; i++) {
+      lval* x = lval_eval(e, lval_read(t->children[i]));
+      lval_println(x);
+      lval_del(x);
+    }
+    mpc_ast_delete(t);
+
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+  }
+
+  free(input);
+}
+
 int main(int argc, char** argv) {
   /* Create Some Parsers */
   mpc_parser_t* Number   = mpc_new("number");
@@ -722,16 +783,19 @@ int main(int argc, char** argv) {
   mpc_parser_t* Lispy    = mpc_new("lispy");
 
   /* Define them with the following Language */
-  mpca_lang(MPCA_LANG_DEFAULT,
+  /* Whitespace is explicit so that a newline only ends the input */
+  /* at the top level, letting expressions continue across lines  */
+  /* Once a bracket is open there is no other way to read the form */
+  mpca_lang(MPCA_LANG_WHITESPACE_SENSITIVE,
 	    "                                                           \
     decimal  : /-?[0-9]+\\.[0-9]+/ ;					\
     integer  : /-?[0-9]+/ ;						\
     number   : <decimal> | <integer> ;					\
     symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%]+/ ;			\
-    sexpr    : '(' <expr>* ')' ;					\
-    qexpr    : '{' <expr>* '}' ;					\
+    sexpr    : '(' ~ /\\s*/ (<expr> /\\s*/)* ')' ;			\
+    qexpr    : '{' ~ /\\s*/ (<expr> /\\s*/)* '}' ;			\
     expr     : <number> | <symbol> | <sexpr> | <qexpr>  ;		\
-    lispy    : /^/ <expr>+ /$/ ;					\
+    lispy    : /[ \\t]*/ (<expr> /[ \\t]*/)+ /\\r?\\n/ ;			\
   ",
 	    Decimal, Integer, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
 
@@ -743,44 +807,84 @@ int main(int argc, char** argv) {
   lenv* e = lenv_new();
   lenv_add_builtins(e);
 
+  /* Lay the grammar out flat once, it is what every line is parsed with */
+  mpc_parser_t* Program = mpc_compile(Lispy);
+
+  /* Lines are fed in as they arrive and parsing resumes where it stopped */
+  mpc_parse_ctx_t* ctx = mpc_parse_ctx_new("<stdin>", Program);
+
+  /* Any files given are run one after another before the prompt */
+  /* With -b the prompt is skipped and the files are all that runs  */
+  int batch = 0;
+  int files = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-b") == 0) { batch = 1; } else { files++; }
+  }
+
+  if (files > 0) {
+    mpc_parser_t* Blank = mpc_apply(mpc_re("[ \\t]*\\r?\\n"), mpcf_free);
+    mpc_parser_t* Line = mpc_or(2, Lispy, Blank);
+    mpc_parser_t* Lines = mpc_whole(mpc_many(fold_lines, Line), (mpc_dtor_t)mpc_ast_delete);
+    mpc_parser_t* File = mpc_compile(Lines);
+    mpc_delete(Lines);
+
+    for (int i = 1; i < argc; i++) {
+      if (strcmp(argv[i], "-b") != 0) { load_file(e, File, argv[i]); }
+    }
+
+    mpc_delete(File);
+  }
+
   /* In a never ending loop */
-  int exit = 0;
+  int exit = batch;
   while (!exit) {
 
-    /* Output our prompt and get input*/
-    char* input = readline("lispy> ");
+    /* Output our prompt and get input, continuing any open expression */
+    char* input = readline(mpc_parse_pending(ctx) ? "  ...> " : "lispy> ");
 
     add_history(input);
 
     /* Attempt to Parse the user Input */
     mpc_result_t r;
-    if (mpc_parse("<stdin>", input, Lispy, &r)) {
-      /* On Success Print the AST */
-      
-      //mpc_ast_print(r.output);
+    int status = mpc_parse_feed(ctx, input, strlen(input), &r);
+    if (status == MPC_PARSE_MORE) {
+      status = mpc_parse_feed(ctx, "\n", 1, &r);
+    }
 
-      lval* x = lval_eval(e, lval_read(r.output));
+    while (!exit && status != MPC_PARSE_MORE) {
 
-      if (strcmp(x->sym, "exit") == 0) 
-	exit = 1;
+      if (status == MPC_PARSE_DONE) {
+        /* On Success Print the AST */
 
-      lval_println(x);
-      lval_del(x);
+        //mpc_ast_print(r.output);
+
+        lval* x = lval_eval(e, lval_read(r.output));
 
-      //printf("Leaves: %i\n", count_leaves(r.output));
-      //printf("Branches: %i\n", count_branches(r.output));
+        if (strcmp(x->sym, "exit") == 0) 
+	  exit = 1;
 
-      mpc_ast_delete(r.output);
+        lval_println(x);
+        lval_del(x);
+
+        //printf("Leaves: %i\n", count_leaves(r.output));
+        //printf("Branches: %i\n", count_branches(r.output));
+
+        mpc_ast_delete(r.output);
+
+      } else {
+        /* Otherwise Print the Error */
+        mpc_err_print(r.error);
+        mpc_err_delete(r.error);
+      }
 
-    } else {
-      /* Otherwise Print the Error */
-      mpc_err_print(r.error);
-      mpc_err_delete(r.error);
+      status = mpc_parse_feed(ctx, NULL, 0, &r);
     }
 
     free(input);
   }
 
+  mpc_parse_ctx_delete(ctx);
+  mpc_delete(Program);
   lenv_del(e);
 
   /* Free parsers */
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mpc.h"
+
+/*
+** Checks for incremental reparsing.
+**
+** Each case is an old text, one edit and the
+** new text. The old tree is reparsed with the
+** edit and must equal a full parse of the new
+** text, positions included. After the fixed
+** cases come random one-character edits on a
+** generated Lispy file, checked the same way.
+**
+** usage: reparse [edits] [seed]
+*/
+
+typedef struct {
+  const char* before;
+  int pos, removed, added;
+  const char* after;
+} edit_case;
+
+static edit_case cases[] = {
+  /* The token before the edit must be allowed to run on */
+  { "(+ 12x)",       5, 1, 1, "(+ 125)" },
+  { "(+ 12 x)",      5, 1, 0, "(+ 12x)" },
+  { "(+ 12 5)",      5, 1, 0, "(+ 125)" },
+  { "(+ ab 1)",      5, 0, 1, "(+ abc 1)" },
+  { "(+ 1 2)",       3, 1, 2, "(+ 10 2)" },
+  { "(a {b c} d)",   7, 0, 2, "(a {b cc } d)" },
+  { "(a b)\n(c d)",  6, 1, 1, "(a b)\n[c d)" },
+};
+
+static int same(mpc_ast_t* a, mpc_ast_t* b) {
+  if (strcmp(a->tag, b->tag) != 0) { return 0; }
+  if (strcmp(a->contents, b->contents) != 0) { return 0; }
+  if (a->children_num != b->children_num) { return 0; }
+  if (a->state.pos != b->state.pos) { return 0; }
+  if (a->state.row != b->state.row) { return 0; }
+  if (a->state.col != b->state.col) { return 0; }
+  for (int k = 0; k < a->children_num; k++) {
+    if (!same(a->children[k], b->children[k])) { return 0; }
+  }
+  return 1;
+}
+
+/* Reparse and compare with a full parse, taking the old tree */
+static int check(mpc_parser_t* p, mpc_ast_t** tree, const char* after, mpc_edit_t* e) {
+
+  mpc_result_t r, full;
+  int ok = mpca_reparse("<reparse>", after, *tree, e, 1, p, &r);
+  int full_ok = mpc_parse("<reparse>", after, p, &full);
+
+  if (ok != full_ok) {
+    if (ok) { *tree = r.output; } else { mpc_err_delete(r.error); }
+    if (full_ok) { mpc_ast_delete(*tree); *tree = full.output; } else { mpc_err_delete(full.error); }
+    return 0;
+  }
+
+  if (!ok) {
+    mpc_err_delete(r.error);
+    mpc_err_delete(full.error);
+    return 1;
+  }
+
+  ok = same(r.output, full.output);
+  mpc_ast_delete(r.output);
+  *tree = full.output;
+  return ok;
+}
+
+int main(int argc, char** argv) {
+
+  int edits = argc > 1 ? atoi(argv[1]) : 1000;
+  srand(argc > 2 ? atoi(argv[2]) : 1);
+
+  mpc_parser_t* Number   = mpc_new("number");
+  mpc_parser_t* Integer  = mpc_new("integer");
+  mpc_parser_t* Decimal  = mpc_new("decimal");
+  mpc_parser_t* Symbol   = mpc_new("symbol");
+  mpc_parser_t* Sexpr    = mpc_new("sexpr");
+  mpc_parser_t* Qexpr    = mpc_new("qexpr");
+  mpc_parser_t* Expr     = mpc_new("expr");
+  mpc_parser_t* Lispy    = mpc_new("lispy");
+
+  mpca_lang(MPCA_LANG_DEFAULT,
+    "                                                       \
+    decimal  : /-?[0-9]+\\.[0-9]+/ ;                        \
+    integer  : /-?[0-9]+/ ;                                 \
+    number   : <decimal> | <integer> ;                      \
+    symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%]+/ ;          \
+    sexpr    : '(' <expr>* ')' ;                            \
+    qexpr    : '{' <expr>* '}' ;                            \
+    expr     : <number> | <symbol> | <sexpr> | <qexpr> ;    \
+    lispy    : /^/ <expr>+ /$/ ;                            \
+  ",
+    Decimal, Integer, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+
+  int failed = 0;
+  mpc_result_t r;
+  mpc_ast_t* tree;
+
+  /* Fixed cases */
+  for (int k = 0; k < (int)(sizeof(cases) / sizeof(cases[0])); k++) {
+
+    if (!mpc_parse("<reparse>", cases[k].before, Lispy, &r)) {
+      mpc_err_print(r.error);
+      mpc_err_delete(r.error);
+      failed = 1;
+      continue;
+    }
+
+    mpc_edit_t e = { cases[k].pos, cases[k].removed, cases[k].added };
+    tree = r.output;
+    if (!check(Lispy, &tree, cases[k].after, &e)) {
+      printf("Case %i: '%s' to '%s' differs from a full parse!\n", k, cases[k].before, cases[k].after);
+      failed = 1;
+    }
+    if (tree) { mpc_ast_delete(tree); }
+  }
+
+  /* Random edits, each one to the text the last one left */
+  const char* chars = "ab1 ()x{}\n-.";
+  int len = 0, accepted = 0, mismatches = 0;
+  char* text = malloc(1024 + edits + 1);
+  char* next = malloc(1024 + edits + 1);
+  text[0] = '\0';
+  for (int k = 0; len < 960; k++) {
+    len += sprintf(text + len, "(def {f%i} (\\ {x y}\n  (+ x (* y %i.5) {a b (c)})))\n", k, k);
+  }
+
+  mpc_parse("<reparse>", text, Lispy, &r);
+  tree = r.output;
+
+  for (int k = 0; k < edits; k++) {
+
+    int pos = rand() % (len + 1);
+    int kind = rand() % 3;
+    char c = chars[rand() % strlen(chars)];
+    if (kind != 0 && pos == len) { pos = len - 1; }
+
+    mpc_edit_t e = { pos, kind == 0 ? 0 : 1, kind == 1 ? 0 : 1 };
+    memcpy(next, text, pos);
+    if (e.added) { next[pos] = c; }
+    strcpy(next + pos + e.added, text + pos + e.removed);
+
+    /* Only edits that leave the text parseable are kept */
+    if (!mpc_parse("<reparse>", next, Lispy, &r)) {
+      mpc_err_delete(r.error);
+      continue;
+    }
+    mpc_ast_delete(r.output);
+
+    accepted++;
+    if (!check(Lispy, &tree, next, &e)) { mismatches++; }
+
+    char* t = text; text = next; next = t;
+    len = strlen(text);
+  }
+
+  printf("%i of %i random edits kept, %i mismatches\n", accepted, edits, mismatches);
+  if (mismatches) { failed = 1; }
+
+  mpc_ast_delete(tree);
+  free(text);
+  free(next);
+
+  mpc_cleanup(8, Number, Integer, Decimal, Symbol, Sexpr, Qexpr, Expr, Lispy);
+
+  return failed;
+}
@@ -0,0 +1,177 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "mpc.h"
+
+/*
+** Stress test for sharing one grammar between threads.
+**
+** The Lispy grammar is built once and then every worker
+** parses the same input with it at the same time. Each
+** result is checked against one made before any thread
+** started, and a broken input is parsed now and then so
+** that error reporting is run concurrently too.
+**
+** usage: stress [forms] [rounds] [max threads]
+*/
+
+typedef struct {
+  mpc_parser_t* parser;
+  const char* good;
+  const char* bad;
+  mpc_ast_t* expect;
+  const char* expect_err;
+  int rounds;
+  int mismatches;
+} job;
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void* work(void* arg) {
+  job* j = arg;
+  mpc_result_t r;
+  char* e;
+
+  for (int k = 0; k < j->rounds; k++) {
+
+    if (mpc_parse("<stress>", j->good, j->parser, &r)) {
+      if (!mpc_ast_eq(r.output, j->expect)) { j->mismatches++; }
+      mpc_ast_delete(r.output);
+    } else {
+      j->mismatches++;
+      mpc_err_delete(r.error);
+    }
+
+    if (k % 8 == 0) {
+      if (mpc_parse("<stress>", j->bad, j->parser, &r)) {
+        j->mismatches++;
+        mpc_ast_delete(r.output);
+      } else {
+        e = mpc_err_string(r.error);
+        if (strcmp(e, j->expect_err) != 0) { j->mismatches++; }
+        free(e);
+        mpc_err_delete(r.error);
+      }
+    }
+
+  }
+
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+
+  int forms   = argc > 1 ? atoi(argv[1]) : 500;
+  int rounds  = argc > 2 ? atoi(argv[2]) : 40;
+  int threads = argc > 3 ? atoi(argv[3]) : (int)sysconf(_SC_NPROCESSORS_ONLN) * 2;
+  if (threads < 1) { threads = 1; }
+
+  mpc_parser_t* Number   = mpc_new("number");
+  mpc_parser_t* Integer  = mpc_new("integer");
+  mpc_parser_t* Decimal  = mpc_new("decimal");
+  mpc_parser_t* Symbol   = mpc_new("symbol");
+  mpc_parser_t* Sexpr    = mpc_new("sexpr");
+  mpc_parser_t* Qexpr    = mpc_new("qexpr");
+  mpc_parser_t* Expr     = mpc_new("expr");
+  mpc_parser_t* Lispy    = mpc_new("lispy");
+
+  mpca_lang(MPCA_LANG_DEFAULT,
+    "                                                       \
+    decimal  : /-?[0-9]+\\.[0-9]+/ ;                        \
+    integer  : /-?[0-9]+/ ;                                 \
+    number   : <decimal> | <integer> ;                      \
+    symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%]+/ ;          \
+    sexpr    : '(' <expr>* ')' ;                            \
+    qexpr    : '{' <expr>* '}' ;                            \
+    expr     : <number> | <symbol> | <sexpr> | <qexpr> ;    \
+    lispy    : /^/ <expr>+ /$/ ;                            \
+  ",
+    Decimal, Integer, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+
+  /* Input */
+  char* good = malloc(forms * 64 + 1);
+  int len = 0;
+  good[0] = '\0';
+  for (int k = 0; k < forms; k++) {
+    len += sprintf(good + len, "(def {x%i} (+ %i 2.5 {a b}))\n", k, k);
+  }
+
+  char* bad = malloc(len + 2);
+  strcpy(bad, good);
+  bad[len / 2] = ')';
+
+  /* Reference results made on this thread alone */
+  mpc_result_t r;
+  if (!mpc_parse("<stress>", good, Lispy, &r)) {
+    mpc_err_print(r.error);
+    return 1;
+  }
+  mpc_ast_t* expect = r.output;
+
+  char* expect_err = NULL;
+  if (mpc_parse("<stress>", bad, Lispy, &r)) {
+    puts("Broken input parsed!");
+    return 1;
+  }
+  expect_err = mpc_err_string(r.error);
+  mpc_err_delete(r.error);
+
+  printf("%i bytes, %i rounds per thread\n", len, rounds);
+  printf("%8s %10s %10s %8s\n", "threads", "time(s)", "MB/s", "speedup");
+
+  int failed = 0;
+  double base = 0;
+
+  for (int n = 1; n <= threads; n *= 2) {
+
+    job* jobs = malloc(sizeof(job) * n);
+    pthread_t* ids = malloc(sizeof(pthread_t) * n);
+
+    for (int k = 0; k < n; k++) {
+      jobs[k].parser = Lispy;
+      jobs[k].good = good;
+      jobs[k].bad = bad;
+      jobs[k].expect = expect;
+      jobs[k].expect_err = expect_err;
+      jobs[k].rounds = rounds;
+      jobs[k].mismatches = 0;
+    }
+
+    double t0 = now();
+    for (int k = 0; k < n; k++) { pthread_create(&ids[k], NULL, work, &jobs[k]); }
+    for (int k = 0; k < n; k++) { pthread_join(ids[k], NULL); }
+    double t1 = now();
+
+    double rate = (double)len * rounds * n / (t1 - t0) / 1e6;
+    if (n == 1) { base = rate; }
+    printf("%8i %10.3f %10.2f %7.2fx\n", n, t1 - t0, rate, rate / base);
+
+    for (int k = 0; k < n; k++) {
+      if (jobs[k].mismatches) {
+        printf("Thread %i of %i: %i mismatched results!\n", k, n, jobs[k].mismatches);
+        failed = 1;
+      }
+    }
+
+    free(jobs);
+    free(ids);
+  }
+
+  mpc_ast_delete(expect);
+  free(expect_err);
+  free(good);
+  free(bad);
+
+  mpc_cleanup(8, Number, Integer, Decimal, Symbol, Sexpr, Qexpr, Expr, Lispy);
+
+  return failed;
+}
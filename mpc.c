@@ -1,5 +1,277 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include "mpc.h"
 
+#include <limits.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MPC_USE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(MPC_NO_PTHREAD)
+#define MPC_USE_PTHREAD
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/* The little process wide state there is gets locked where threads are available */
+#ifdef MPC_USE_PTHREAD
+typedef pthread_mutex_t mpc_mutex_t;
+#define MPC_MUTEX(m) static mpc_mutex_t m = PTHREAD_MUTEX_INITIALIZER
+#define MPC_MUTEX_INIT(m) pthread_mutex_init(&(m), NULL)
+#define MPC_MUTEX_FREE(m) pthread_mutex_destroy(&(m))
+#define MPC_LOCK(m) pthread_mutex_lock(&(m))
+#define MPC_UNLOCK(m) pthread_mutex_unlock(&(m))
+#else
+typedef int mpc_mutex_t;
+#define MPC_MUTEX(m) static mpc_mutex_t m = 0
+#define MPC_MUTEX_INIT(m) ((m) = 0)
+#define MPC_MUTEX_FREE(m) (void)(m)
+#define MPC_LOCK(m) (void)(m)
+#define MPC_UNLOCK(m) (void)(m)
+#endif
+
+#ifdef MPC_PROFILE
+#include <time.h>
+#endif
+
+/*
+** Arenas
+**
+** A parse can be handed an arena, and then all
+** it allocates, outputs, errors, AST nodes and
+** the rest, is bumped off the end of some large
+** blocks and let go of in one go along with the
+** arena.
+**
+** Folds deep inside a parse are not given any
+** context, so the arena in use is kept per
+** thread. The library allocates parse results
+** through `mpc_malloc` and friends, which just
+** use the heap when no arena is in use. Freeing
+** something an arena owns does nothing, unless
+** it was the very last thing allocated.
+**
+** User folds and destructors that are run in an
+** arena parse must allocate and free with these
+** too. The workers of `mpc_parse_parallel` are
+** other threads, so never see the arena.
+*/
+
+#if defined(__GNUC__) && !defined(MPC_NO_TLS)
+#define MPC_TLS __thread
+#elif defined(_MSC_VER) && !defined(MPC_NO_TLS)
+#define MPC_TLS __declspec(thread)
+#else
+#define MPC_TLS
+#endif
+
+typedef union {
+  long l;
+  double d;
+  void *p;
+  size_t n;
+} mpc_align_t;
+
+typedef struct mpc_block_t {
+  struct mpc_block_t *next;
+  void *raw;
+  size_t size;
+  size_t used;
+} mpc_block_t;
+
+/*
+** Blocks start on a page boundary and every
+** page they cover is kept in a small hash
+** table. So finding out whether some pointer
+** belongs to the arena is one lookup of its
+** page, however many blocks there are.
+*/
+
+typedef struct {
+  size_t page;
+  mpc_block_t *block;
+} mpc_page_t;
+
+struct mpc_arena_t {
+  mpc_block_t *blocks;
+  char *last;
+  mpc_page_t *pages;
+  size_t pages_num;
+  size_t pages_slots;
+};
+
+enum {
+  MPC_ARENA_BLOCK = 4096,
+  MPC_ARENA_PAGE  = 4096
+};
+
+#define MPC_ARENA_ROUND(n) (((n) + sizeof(mpc_align_t) - 1) / sizeof(mpc_align_t) * sizeof(mpc_align_t))
+#define MPC_ARENA_DATA(b) ((char*)(b) + MPC_ARENA_ROUND(sizeof(mpc_block_t)))
+#define MPC_ARENA_PAGE_OF(p) ((size_t)(p) / MPC_ARENA_PAGE)
+
+static MPC_TLS mpc_arena_t *mpc_arena_current = NULL;
+
+mpc_arena_t *mpc_arena_new(void) {
+  mpc_arena_t *a = malloc(sizeof(mpc_arena_t));
+  a->blocks = NULL;
+  a->last = NULL;
+  a->pages = NULL;
+  a->pages_num = 0;
+  a->pages_slots = 0;
+  return a;
+}
+
+static mpc_page_t *mpc_arena_page_slot(mpc_arena_t *a, size_t page) {
+  size_t h = (page * 2654435761u) & (a->pages_slots-1);
+  while (a->pages[h].block && a->pages[h].page != page) { h = (h+1) & (a->pages_slots-1); }
+  return &a->pages[h];
+}
+
+static void mpc_arena_page_insert(mpc_arena_t *a, size_t page, mpc_block_t *b) {
+  
+  size_t k, slots;
+  mpc_page_t *old, *x;
+  
+  if ((a->pages_num + 1) * 2 > a->pages_slots) {
+    old = a->pages;
+    slots = a->pages_slots;
+    a->pages_slots = slots ? slots * 2 : 64;
+    a->pages = calloc(a->pages_slots, sizeof(mpc_page_t));
+    for (k = 0; k < slots; k++) {
+      if (old[k].block) { *mpc_arena_page_slot(a, old[k].page) = old[k]; }
+    }
+    free(old);
+  }
+  
+  x = mpc_arena_page_slot(a, page);
+  if (x->block == NULL) { a->pages_num++; }
+  x->page = page;
+  x->block = b;
+}
+
+static void mpc_arena_pages_add(mpc_arena_t *a, mpc_block_t *b) {
+  size_t k;
+  size_t first = MPC_ARENA_PAGE_OF(b);
+  size_t last = MPC_ARENA_PAGE_OF(MPC_ARENA_DATA(b) + b->size - 1);
+  for (k = first; k <= last; k++) { mpc_arena_page_insert(a, k, b); }
+}
+
+/* Keeps the newest, and so biggest, block for reuse */
+void mpc_arena_clear(mpc_arena_t *a) {
+  mpc_block_t *b, *n;
+  if (a->blocks == NULL) { return; }
+  for (b = a->blocks->next; b; b = n) { n = b->next; free(b->raw); }
+  a->blocks->next = NULL;
+  a->blocks->used = 0;
+  a->last = NULL;
+  memset(a->pages, 0, sizeof(mpc_page_t) * a->pages_slots);
+  a->pages_num = 0;
+  mpc_arena_pages_add(a, a->blocks);
+}
+
+void mpc_arena_delete(mpc_arena_t *a) {
+  mpc_block_t *b, *n;
+  for (b = a->blocks; b; b = n) { n = b->next; free(b->raw); }
+  free(a->pages);
+  free(a);
+}
+
+/* Each allocation is preceded by its size so it can be grown */
+static void *mpc_arena_alloc(mpc_arena_t *a, size_t n) {
+  
+  mpc_block_t *b = a->blocks;
+  size_t need = MPC_ARENA_ROUND(n) + sizeof(mpc_align_t);
+  size_t size;
+  char *raw, *x;
+  
+  if (b == NULL || b->used + need > b->size) {
+    size = b ? b->size * 2 : MPC_ARENA_BLOCK;
+    while (size < need) { size *= 2; }
+    raw = malloc(MPC_ARENA_PAGE + MPC_ARENA_ROUND(sizeof(mpc_block_t)) + size);
+    b = (mpc_block_t*)(raw + (MPC_ARENA_PAGE - (size_t)raw % MPC_ARENA_PAGE));
+    b->next = a->blocks;
+    b->raw = raw;
+    b->size = size;
+    b->used = 0;
+    a->blocks = b;
+    mpc_arena_pages_add(a, b);
+  }
+  
+  x = MPC_ARENA_DATA(b) + b->used;
+  ((mpc_align_t*)x)->n = n;
+  b->used += need;
+  a->last = x + sizeof(mpc_align_t);
+  return a->last;
+}
+
+static int mpc_arena_owns(mpc_arena_t *a, void *p) {
+  mpc_block_t *b;
+  if (a->pages_slots == 0) { return 0; }
+  b = mpc_arena_page_slot(a, MPC_ARENA_PAGE_OF(p))->block;
+  return b && (char*)p >= MPC_ARENA_DATA(b) && (char*)p < MPC_ARENA_DATA(b) + b->used;
+}
+
+void *mpc_malloc(size_t n) {
+  return mpc_arena_current ? mpc_arena_alloc(mpc_arena_current, n) : malloc(n);
+}
+
+void *mpc_calloc(size_t n, size_t m) {
+  void *x;
+  if (mpc_arena_current == NULL) { return calloc(n, m); }
+  x = mpc_arena_alloc(mpc_arena_current, n * m);
+  memset(x, 0, n * m);
+  return x;
+}
+
+/*
+** The last allocation made is grown where it
+** lies, which is the usual case for strings
+** and child lists being built up. Otherwise it
+** is copied. Heap memory stays on the heap.
+*/
+
+void *mpc_realloc(void *p, size_t n) {
+  
+  mpc_arena_t *a = mpc_arena_current;
+  mpc_block_t *b;
+  size_t old;
+  void *x;
+  
+  if (a == NULL || (p && !mpc_arena_owns(a, p))) { return realloc(p, n); }
+  if (p == NULL) { return mpc_arena_alloc(a, n); }
+  
+  b = a->blocks;
+  old = ((mpc_align_t*)p - 1)->n;
+  
+  if (p == a->last && b->used - MPC_ARENA_ROUND(old) + MPC_ARENA_ROUND(n) <= b->size) {
+    b->used = b->used - MPC_ARENA_ROUND(old) + MPC_ARENA_ROUND(n);
+    ((mpc_align_t*)p - 1)->n = n;
+    return p;
+  }
+  
+  x = mpc_arena_alloc(a, n);
+  memcpy(x, p, old < n ? old : n);
+  return x;
+}
+
+void mpc_free(void *p) {
+  
+  mpc_arena_t *a = mpc_arena_current;
+  
+  if (a == NULL || (p && !mpc_arena_owns(a, p))) { free(p); return; }
+  
+  if (p && p == a->last) {
+    a->blocks->used -= MPC_ARENA_ROUND(((mpc_align_t*)p - 1)->n) + sizeof(mpc_align_t);
+    a->last = NULL;
+  }
+}
+
 /*
 ** State Type
 */
@@ -21,7 +293,7 @@ static mpc_state_t mpc_state_new(void) {
 }
 
 static mpc_state_t *mpc_state_copy(mpc_state_t s) {
-  mpc_state_t *r = malloc(sizeof(mpc_state_t));
+  mpc_state_t *r = mpc_malloc(sizeof(mpc_state_t));
   memcpy(r, &s, sizeof(mpc_state_t));
   return r;
 }
@@ -31,13 +303,13 @@ static mpc_state_t *mpc_state_copy(mpc_state_t s) {
 */
 
 static mpc_err_t *mpc_err_new(const char *filename, mpc_state_t s, const char *expected, char recieved) {
-  mpc_err_t *x = malloc(sizeof(mpc_err_t));
-  x->filename = malloc(strlen(filename) + 1);
+  mpc_err_t *x = mpc_malloc(sizeof(mpc_err_t));
+  x->filename = mpc_malloc(strlen(filename) + 1);
   strcpy(x->filename, filename);
   x->state = s;
   x->expected_num = 1;
-  x->expected = malloc(sizeof(char*));
-  x->expected[0] = malloc(strlen(expected) + 1);
+  x->expected = mpc_malloc(sizeof(char*));
+  x->expected[0] = mpc_malloc(strlen(expected) + 1);
   strcpy(x->expected[0], expected);
   x->failure = NULL;
   x->recieved = recieved;
@@ -45,13 +317,13 @@ static mpc_err_t *mpc_err_new(const char *filename, mpc_state_t s, const char *e
 }
 
 static mpc_err_t *mpc_err_fail(const char *filename, mpc_state_t s, const char *failure) {
-  mpc_err_t *x = malloc(sizeof(mpc_err_t));
-  x->filename = malloc(strlen(filename) + 1);
+  mpc_err_t *x = mpc_malloc(sizeof(mpc_err_t));
+  x->filename = mpc_malloc(strlen(filename) + 1);
   strcpy(x->filename, filename);
   x->state = s;
   x->expected_num = 0;
   x->expected = NULL;
-  x->failure = malloc(strlen(failure) + 1);
+  x->failure = mpc_malloc(strlen(failure) + 1);
   strcpy(x->failure, failure);
   x->recieved = ' ';
   return x;
@@ -61,13 +333,35 @@ void mpc_err_delete(mpc_err_t *x) {
 
   int i;
   for (i = 0; i < x->expected_num; i++) {
-    free(x->expected[i]);
+    mpc_free(x->expected[i]);
   }
   
-  free(x->expected);
-  free(x->filename);
-  free(x->failure);
-  free(x);
+  mpc_free(x->expected);
+  mpc_free(x->filename);
+  mpc_free(x->failure);
+  mpc_free(x);
+}
+
+static mpc_err_t *mpc_err_copy(mpc_err_t *x) {
+  
+  int i;
+  mpc_err_t *y = mpc_malloc(sizeof(mpc_err_t));
+  y->filename = mpc_malloc(strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->state = x->state;
+  y->expected_num = x->expected_num;
+  y->expected = x->expected_num ? mpc_malloc(sizeof(char*) * x->expected_num) : NULL;
+  for (i = 0; i < x->expected_num; i++) {
+    y->expected[i] = mpc_malloc(strlen(x->expected[i]) + 1);
+    strcpy(y->expected[i], x->expected[i]);
+  }
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = mpc_malloc(strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  y->recieved = x->recieved;
+  return y;
 }
 
 static int mpc_err_contains_expected(mpc_err_t *x, char *expected) {
@@ -83,8 +377,8 @@ static int mpc_err_contains_expected(mpc_err_t *x, char *expected) {
 static void mpc_err_add_expected(mpc_err_t *x, char *expected) {
   
   x->expected_num++;
-  x->expected = realloc(x->expected, sizeof(char*) * x->expected_num);
-  x->expected[x->expected_num-1] = malloc(strlen(expected) + 1);
+  x->expected = mpc_realloc(x->expected, sizeof(char*) * x->expected_num);
+  x->expected[x->expected_num-1] = mpc_malloc(strlen(expected) + 1);
   strcpy(x->expected[x->expected_num-1], expected);
   
 }
@@ -93,11 +387,11 @@ static void mpc_err_clear_expected(mpc_err_t *x, char *expected) {
   
   int i;
   for (i = 0; i < x->expected_num; i++) {
-    free(x->expected[i]);
+    mpc_free(x->expected[i]);
   }
   x->expected_num = 1;
-  x->expected = realloc(x->expected, sizeof(char*) * x->expected_num);
-  x->expected[0] = malloc(strlen(expected) + 1);
+  x->expected = mpc_realloc(x->expected, sizeof(char*) * x->expected_num);
+  x->expected[0] = mpc_malloc(strlen(expected) + 1);
   strcpy(x->expected[0], expected);
   
 }
@@ -122,13 +416,18 @@ void mpc_err_string_cat(char *buffer, int *pos, int *max, char *fmt, ...) {
   va_end(va);
 }
 
-static char char_unescape_buffer[3];
+/*
+** The quoted character is written into a buffer
+** the caller owns rather than one static buffer,
+** so errors can be built on many threads at once.
+*/
 
-static char *mpc_err_char_unescape(char c) {
+static char *mpc_err_char_unescape(char c, char *buffer) {
   
-  char_unescape_buffer[0] = '\'';
-  char_unescape_buffer[1] = ' ';
-  char_unescape_buffer[2] = '\'';
+  buffer[0] = '\'';
+  buffer[1] = ' ';
+  buffer[2] = '\'';
+  buffer[3] = '\0';
   
   switch (c) {
     
@@ -142,8 +441,8 @@ static char *mpc_err_char_unescape(char c) {
     case '\t': return "tab";
     case ' ' : return "space";
     default:
-      char_unescape_buffer[1] = c;
-      return char_unescape_buffer;
+      buffer[1] = c;
+      return buffer;
   }
   
 }
@@ -154,6 +453,7 @@ char *mpc_err_string(mpc_err_t *x) {
   int max = 1023;
   int pos = 0; 
   int i;
+  char c[4];
   
   if (x->failure) {
     mpc_err_string_cat(buffer, &pos, &max,
@@ -179,7 +479,7 @@ char *mpc_err_string(mpc_err_t *x) {
   }
   
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved));
+  mpc_err_string_cat(buffer, &pos, &max, "%s", mpc_err_char_unescape(x->recieved, c));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
   
   return realloc(buffer, strlen(buffer) + 1);
@@ -188,12 +488,12 @@ char *mpc_err_string(mpc_err_t *x) {
 static mpc_err_t *mpc_err_or(mpc_err_t** x, int n) {
   
   int i, j;
-  mpc_err_t *e = malloc(sizeof(mpc_err_t));
+  mpc_err_t *e = mpc_malloc(sizeof(mpc_err_t));
   e->state = mpc_state_invalid();
   e->expected_num = 0;
   e->expected = NULL;
   e->failure = NULL;
-  e->filename = malloc(strlen(x[0]->filename)+1);
+  e->filename = mpc_malloc(strlen(x[0]->filename)+1);
   strcpy(e->filename, x[0]->filename);
   
   for (i = 0; i < n; i++) {
@@ -205,7 +505,7 @@ static mpc_err_t *mpc_err_or(mpc_err_t** x, int n) {
     if (x[i]->state.pos < e->state.pos) { continue; }
     
     if (x[i]->failure) {
-      e->failure = malloc(strlen(x[i]->failure)+1);
+      e->failure = mpc_malloc(strlen(x[i]->failure)+1);
       strcpy(e->failure, x[i]->failure);
       break;
     }
@@ -227,32 +527,32 @@ static mpc_err_t *mpc_err_or(mpc_err_t** x, int n) {
 static mpc_err_t *mpc_err_repeat(mpc_err_t *x, const char *prefix) {
 
   int i;
-  char *expect = malloc(strlen(prefix) + 1);
+  char *expect = mpc_malloc(strlen(prefix) + 1);
   strcpy(expect, prefix);
   
   if (x->expected_num == 1) {
-    expect = realloc(expect, strlen(expect) + strlen(x->expected[0]) + 1);
+    expect = mpc_realloc(expect, strlen(expect) + strlen(x->expected[0]) + 1);
     strcat(expect, x->expected[0]);
   }
   
   if (x->expected_num > 1) {
   
     for (i = 0; i < x->expected_num-2; i++) {
-      expect = realloc(expect, strlen(expect) + strlen(x->expected[i]) + strlen(", ") + 1);
+      expect = mpc_realloc(expect, strlen(expect) + strlen(x->expected[i]) + strlen(", ") + 1);
       strcat(expect, x->expected[i]);
       strcat(expect, ", ");
     }
     
-    expect = realloc(expect, strlen(expect) + strlen(x->expected[x->expected_num-2]) + strlen(" or ") + 1);
+    expect = mpc_realloc(expect, strlen(expect) + strlen(x->expected[x->expected_num-2]) + strlen(" or ") + 1);
     strcat(expect, x->expected[x->expected_num-2]);
     strcat(expect, " or ");
-    expect = realloc(expect, strlen(expect) + strlen(x->expected[x->expected_num-1]) + 1);
+    expect = mpc_realloc(expect, strlen(expect) + strlen(x->expected[x->expected_num-1]) + 1);
     strcat(expect, x->expected[x->expected_num-1]);
 
   }
   
   mpc_err_clear_expected(x, expect);
-  free(expect);
+  mpc_free(expect);
   
   return x;
 
@@ -265,10 +565,10 @@ static mpc_err_t *mpc_err_many1(mpc_err_t *x) {
 static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
   mpc_err_t *y;
   int digits = n/10 + 1;
-  char *prefix = malloc(digits + strlen(" of ") + 1);
+  char *prefix = mpc_malloc(digits + strlen(" of ") + 1);
   sprintf(prefix, "%i of ", n);
   y = mpc_err_repeat(x, prefix);
-  free(prefix);
+  mpc_free(prefix);
   return y;
 }
 
@@ -280,15 +580,20 @@ static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
 ** In mpc the input type has three modes of 
 ** operation: String, File and Pipe.
 **
-** String is easy. The whole contents are 
-** loaded into a buffer and scanned through.
-** The cursor can jump around at will making 
-** backtracking easy.
+** String is easy. The input is borrowed from
+** the caller as a pointer and a length and is
+** never copied. The cursor can jump around at
+** will making backtracking easy, and the end
+** of input is a single bounds check.
 **
 ** The second is a File which is also somewhat
-** easy. The contents are never loaded into 
-** memory but backtracking can still be achieved
-** by seeking in the file at different positions.
+** easy. Where the platform allows it, regular
+** files are mapped into memory and scanned
+** just like a String, with rewinds being a
+** simple pointer move. Otherwise the contents
+** are never loaded into memory but backtracking
+** can still be achieved by seeking in the file
+** at different positions.
 **
 ** The final mode is Pipe. This is the difficult
 ** one. As we assume pipes cannot be seeked - and 
@@ -301,6 +606,27 @@ static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
 ** back we can simply start reading from the
 ** buffer instead of the input.
 **
+** The buffer tracks its own length and grows
+** geometrically. Once the outermost mark is
+** released everything before the cursor is
+** committed and gets dropped, so memory stays
+** bounded by the largest backtracking window
+** rather than the size of the whole input.
+**
+** Only the byte offset of the cursor is kept up
+** to date while parsing. Rows and columns are
+** worked out on demand from an index of newline
+** offsets. For in-memory input the index is
+** filled in lazily by scanning up to the offset
+** asked about, while File and Pipe input note
+** each newline the first time it is read.
+**
+** String input can also be marked as partial,
+** meaning more of it may still arrive. Running
+** off the end then starves the parser instead of
+** failing it, which lets `mpc_parse_feed` suspend
+** the parse and pick it up again later.
+**
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
 ** to parse for all input methods.
@@ -310,29 +636,68 @@ static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
 enum {
   MPC_INPUT_STRING = 0,
   MPC_INPUT_FILE   = 1,
-  MPC_INPUT_PIPE   = 2
+  MPC_INPUT_PIPE   = 2,
+  MPC_INPUT_MMAP   = 3
+};
+
+/*
+** Marks are pushed and popped for almost every
+** combinator step so they live in a stack that
+** only ever grows. The first few are stored in
+** the input itself so shallow grammars never
+** touch the allocator for them at all.
+*/
+
+enum {
+  MPC_INPUT_MARKS_MIN = 32
 };
 
+typedef struct {
+  int pos;
+  char last;
+} mpc_mark_t;
+
 typedef struct {
 
   int type;
   char *filename;  
   mpc_state_t state;
   
-  char *string;
-  char *buffer;
+  const char *string;
+  int length;
   FILE *file;
   
+  char *buffer;
+  int buffer_start;
+  int buffer_num;
+  int buffer_slots;
+  int buffer_pos;
+  
+  void *mapping;
+  long mapping_size;
+  long offset;
+  
   int backtrack;
   int marks_num;
-  mpc_state_t* marks;
-  char* lasts;
+  int marks_slots;
+  mpc_mark_t *marks;
+  mpc_mark_t marks_local[MPC_INPUT_MARKS_MIN];
+  int cut;
   
   char last;
   
+  int partial;
+  int starved;
+  
+  int *lines;
+  int lines_num;
+  int lines_slots;
+  int lines_upto;
+  int lines_base;
+  
 } mpc_input_t;
 
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+static mpc_input_t *mpc_input_new_string(const char *filename, const char *string, int length) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
   
@@ -342,18 +707,37 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   
   i->state = mpc_state_new();
   
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
-  i->buffer = NULL;
+  i->string = string;
+  i->length = length;
   i->file = NULL;
   
+  i->buffer = NULL;
+  i->buffer_start = 0;
+  i->buffer_num = 0;
+  i->buffer_slots = 0;
+  i->buffer_pos = 0;
+  
+  i->mapping = NULL;
+  i->mapping_size = 0;
+  i->offset = 0;
+  
   i->backtrack = 1;
   i->marks_num = 0;
-  i->marks = NULL;
-  i->lasts = NULL;
+  i->cut = 0;
+  i->marks_slots = MPC_INPUT_MARKS_MIN;
+  i->marks = i->marks_local;
 
   i->last = '\0';
   
+  i->partial = 0;
+  i->starved = 0;
+  
+  i->lines = NULL;
+  i->lines_num = 0;
+  i->lines_slots = 0;
+  i->lines_upto = 0;
+  i->lines_base = 0;
+  
   return i;
 }
 
@@ -368,20 +752,76 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
   
   i->string = NULL;
-  i->buffer = NULL;
+  i->length = 0;
   i->file = pipe;
   
+  i->buffer = NULL;
+  i->buffer_start = 0;
+  i->buffer_num = 0;
+  i->buffer_slots = 0;
+  i->buffer_pos = 0;
+  
+  i->mapping = NULL;
+  i->mapping_size = 0;
+  i->offset = 0;
+  
   i->backtrack = 1;
   i->marks_num = 0;
-  i->marks = NULL;
-  i->lasts = NULL;
+  i->cut = 0;
+  i->marks_slots = MPC_INPUT_MARKS_MIN;
+  i->marks = i->marks_local;
   
   i->last = '\0';
   
+  i->partial = 0;
+  i->starved = 0;
+  
+  i->lines = NULL;
+  i->lines_num = 0;
+  i->lines_slots = 0;
+  i->lines_upto = 0;
+  i->lines_base = 0;
+  
   return i;
   
 }
 
+/*
+** Regular files are mapped from the current
+** stream position to the end and then read
+** in place. Anything which cannot be mapped
+** (pipes, terminals, empty files, or files too
+** long for an `int` length) is left to the
+** normal `fgetc`/`fseek` path.
+*/
+
+static void mpc_input_map_file(mpc_input_t *i) {
+#ifdef MPC_USE_MMAP
+  
+  struct stat st;
+  long offset;
+  void *m;
+  int fd = fileno(i->file);
+  
+  if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) { return; }
+  
+  offset = ftell(i->file);
+  if (offset < 0 || st.st_size <= offset) { return; }
+  if (st.st_size - offset > INT_MAX) { return; }
+  
+  m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (m == MAP_FAILED) { return; }
+  
+  i->type = MPC_INPUT_MMAP;
+  i->mapping = m;
+  i->mapping_size = st.st_size;
+  i->offset = offset;
+  i->string = (const char*)m + offset;
+  i->length = st.st_size - offset;
+  
+#endif
+}
+
 static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
@@ -392,16 +832,38 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->state = mpc_state_new();
   
   i->string = NULL;
-  i->buffer = NULL;
+  i->length = 0;
   i->file = file;
   
+  i->buffer = NULL;
+  i->buffer_start = 0;
+  i->buffer_num = 0;
+  i->buffer_slots = 0;
+  i->buffer_pos = 0;
+  
+  i->mapping = NULL;
+  i->mapping_size = 0;
+  i->offset = 0;
+  
+  mpc_input_map_file(i);
+  
   i->backtrack = 1;
   i->marks_num = 0;
-  i->marks = NULL;
-  i->lasts = NULL;
+  i->cut = 0;
+  i->marks_slots = MPC_INPUT_MARKS_MIN;
+  i->marks = i->marks_local;
   
   i->last = '\0';
   
+  i->partial = 0;
+  i->starved = 0;
+  
+  i->lines = NULL;
+  i->lines_num = 0;
+  i->lines_slots = 0;
+  i->lines_upto = 0;
+  i->lines_base = 0;
+  
   return i;
 }
 
@@ -409,31 +871,186 @@ static void mpc_input_delete(mpc_input_t *i) {
   
   free(i->filename);
   
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
   
-  free(i->marks);
-  free(i->lasts);
+#ifdef MPC_USE_MMAP
+  if (i->type == MPC_INPUT_MMAP) {
+    munmap(i->mapping, i->mapping_size);
+    fseek(i->file, i->offset + i->state.pos, SEEK_SET);
+  }
+#endif
+  
+  if (i->marks != i->marks_local) { free(i->marks); }
+  free(i->lines);
   free(i);
 }
 
+static void mpc_input_lines_push(mpc_input_t *i, int pos) {
+  if (i->lines_num == i->lines_slots) {
+    i->lines_slots = i->lines_slots ? i->lines_slots * 2 : 64;
+    i->lines = realloc(i->lines, sizeof(int) * i->lines_slots);
+  }
+  i->lines[i->lines_num++] = pos;
+}
+
+static void mpc_input_lines_scan(mpc_input_t *i, int pos) {
+  
+  const char *x = i->string + i->lines_upto;
+  const char *e = i->string + pos;
+  
+  while ((x = memchr(x, '\n', e - x))) {
+    mpc_input_lines_push(i, x - i->string);
+    x++;
+  }
+  
+  i->lines_upto = pos;
+}
+
+/*
+** The full state of the cursor, or of some
+** earlier position, with the row and column
+** filled in from the newline index.
+*/
+
+static mpc_state_t mpc_input_state_at(mpc_input_t *i, int pos) {
+  
+  mpc_state_t s;
+  int lo = 0, hi, mid;
+  
+  s.pos = pos;
+  
+  if ((i->type == MPC_INPUT_STRING || i->type == MPC_INPUT_MMAP) && s.pos > i->lines_upto) {
+    mpc_input_lines_scan(i, s.pos);
+  }
+  
+  hi = i->lines_num;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (i->lines[mid] < s.pos) { lo = mid + 1; } else { hi = mid; }
+  }
+  
+  s.row = lo + i->lines_base;
+  s.col = lo > 0 ? s.pos - (i->lines[lo-1] + 1) : s.pos;
+  return s;
+}
+
+static mpc_state_t mpc_input_state(mpc_input_t *i) {
+  return mpc_input_state_at(i, i->state.pos);
+}
+
+/*
+** Points string input at the window of it from
+** `start` to `end`, which is then parsed as if it
+** were the whole of the input. Positions are still
+** counted from the start of the string, and to
+** fill in rows it takes the number of newlines
+** before the window and the offset of the last.
+*/
+
+static void mpc_input_window(mpc_input_t *i, int start, int end, int rows, int line) {
+  
+  i->state = mpc_state_new();
+  i->state.pos = start;
+  i->length = end;
+  i->last = '\0';
+  i->backtrack = 1;
+  i->marks_num = 0;
+  i->cut = 0;
+  i->starved = 0;
+  
+  i->lines_num = 0;
+  i->lines_upto = start;
+  i->lines_base = 0;
+  
+  if (line >= 0) {
+    mpc_input_lines_push(i, line);
+    i->lines_base = rows - 1;
+  }
+  
+}
+
 static void mpc_input_backtrack_disable(mpc_input_t *i) { i->backtrack--; }
 static void mpc_input_backtrack_enable(mpc_input_t *i) { i->backtrack++; }
 
+/*
+** Drops buffered pipe input which can no
+** longer be rewound to, which is anything
+** before the outermost mark still open, or
+** before the cursor when nothing is. Marks
+** under `cut` have been committed to and are
+** never rewound to, so they don't count. The
+** dead prefix is only compacted away once it
+** is at least as big as the live data.
+*/
+
+static void mpc_input_buffer_trim(mpc_input_t *i) {
+  
+  int keep = i->marks_num > i->cut ? i->marks[i->cut].pos : i->state.pos;
+  int drop = keep - i->buffer_pos;
+  
+  if (drop <= 0) { return; }
+  
+  if (drop >= i->buffer_num) {
+    i->buffer_start = 0;
+    i->buffer_num = 0;
+    i->buffer_pos = keep;
+    return;
+  }
+  
+  i->buffer_start += drop;
+  i->buffer_num -= drop;
+  i->buffer_pos = keep;
+  
+  if (i->buffer_start >= i->buffer_num) {
+    memmove(i->buffer, i->buffer + i->buffer_start, i->buffer_num);
+    i->buffer_start = 0;
+  }
+}
+
+static void mpc_input_buffer_push(mpc_input_t *i, char c) {
+  
+  if (i->buffer_num == 0) {
+    i->buffer_start = 0;
+    i->buffer_pos = i->state.pos;
+  }
+  
+  if (i->buffer_start + i->buffer_num == i->buffer_slots) {
+    if (i->buffer_start > 0) {
+      memmove(i->buffer, i->buffer + i->buffer_start, i->buffer_num);
+      i->buffer_start = 0;
+    }
+    if (i->buffer_num == i->buffer_slots) {
+      i->buffer_slots = i->buffer_slots ? i->buffer_slots * 2 : 64;
+      i->buffer = realloc(i->buffer, i->buffer_slots);
+    }
+  }
+  
+  i->buffer[i->buffer_start + i->buffer_num] = c;
+  i->buffer_num++;
+}
+
 static void mpc_input_mark(mpc_input_t *i) {
   
   if (i->backtrack < 1) { return; }
   
-  i->marks_num++;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-  i->lasts = realloc(i->lasts, sizeof(char) * i->marks_num);
-  i->marks[i->marks_num-1] = i->state;
-  i->lasts[i->marks_num-1] = i->last;
+  if (i->type == MPC_INPUT_PIPE && i->marks_num == i->cut) {
+    mpc_input_buffer_trim(i);
+  }
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
+  if (i->marks_num == i->marks_slots) {
+    i->marks_slots *= 2;
+    if (i->marks == i->marks_local) {
+      i->marks = malloc(sizeof(mpc_mark_t) * i->marks_slots);
+      memcpy(i->marks, i->marks_local, sizeof(mpc_mark_t) * i->marks_num);
+    } else {
+      i->marks = realloc(i->marks, sizeof(mpc_mark_t) * i->marks_slots);
+    }
   }
   
+  i->marks[i->marks_num].pos = i->state.pos;
+  i->marks[i->marks_num].last = i->last;
+  i->marks_num++;
+  
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
@@ -441,67 +1058,94 @@ static void mpc_input_unmark(mpc_input_t *i) {
   if (i->backtrack < 1) { return; }
   
   i->marks_num--;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-  i->lasts = realloc(i->lasts, sizeof(char) * i->marks_num);
+  if (i->cut > i->marks_num) { i->cut = i->marks_num; }
   
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    free(i->buffer);
-    i->buffer = NULL;
+  if (i->type == MPC_INPUT_PIPE && i->marks_num == i->cut) {
+    mpc_input_buffer_trim(i);
   }
   
 }
 
-static void mpc_input_rewind(mpc_input_t *i) {
+/*
+** Returns zero, and leaves the position where
+** it is, if the mark has been committed to by
+** a cut and so can't be gone back to.
+*/
+
+static int mpc_input_rewind(mpc_input_t *i) {
   
-  if (i->backtrack < 1) { return; }
+  if (i->backtrack < 1) { return 1; }
+  
+  if (i->marks_num <= i->cut) {
+    mpc_input_unmark(i);
+    return 0;
+  }
   
-  i->state = i->marks[i->marks_num-1];
-  i->last  = i->lasts[i->marks_num-1];
+  i->state.pos = i->marks[i->marks_num-1].pos;
+  i->last  = i->marks[i->marks_num-1].last;
   
   if (i->type == MPC_INPUT_FILE) {
     fseek(i->file, i->state.pos, SEEK_SET);
   }
   
   mpc_input_unmark(i);
+  return 1;
+}
+
+/*
+** Commits to every mark currently held, so
+** pipe input can let go of all it buffered
+** for them.
+*/
+
+static void mpc_input_cut(mpc_input_t *i) {
+  i->cut = i->marks_num;
+  if (i->type == MPC_INPUT_PIPE) { mpc_input_buffer_trim(i); }
 }
 
 static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (strlen(i->buffer) + i->marks[0].pos);
+  return i->state.pos < i->buffer_pos + i->buffer_num;
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+  return i->buffer[i->buffer_start + (i->state.pos - i->buffer_pos)];
 }
 
-static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == strlen(i->string)) { return 1; }
-  if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
-  if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
-  return 0;
-}
+/*
+** Fetches the next character into `c`. The
+** state only moves on in `mpc_input_success`.
+** Returns zero at the end of the input.
+*/
 
-static char mpc_input_getc(mpc_input_t *i) {
+static int mpc_input_getc(mpc_input_t *i, char *c) {
   
-  char c;
+  int x;
   switch (i->type) {
     
-    case MPC_INPUT_STRING: c = i->string[i->state.pos]; break;
-    case MPC_INPUT_FILE: c = fgetc(i->file); break;
+    case MPC_INPUT_STRING:
+    case MPC_INPUT_MMAP:
+      if (i->state.pos >= i->length) { i->starved = i->partial; return 0; }
+      *c = i->string[i->state.pos];
+      return 1;
+    
+    case MPC_INPUT_FILE: x = fgetc(i->file); break;
     case MPC_INPUT_PIPE:
     
-      if (!i->buffer) { c = getc(i->file); break; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        c = mpc_input_buffer_get(i);
-      } else {
-        c = getc(i->file);
+      if (mpc_input_buffer_in_range(i)) {
+        *c = mpc_input_buffer_get(i);
+        return 1;
       }
+      
+      x = getc(i->file);
     
     break;
     
+    default: return 0;
   }
   
-  return c;
+  if (x == EOF) { return 0; }
+  *c = x;
+  return 1;
 }
 
 static char mpc_input_peekc(mpc_input_t *i) {
@@ -509,7 +1153,10 @@ static char mpc_input_peekc(mpc_input_t *i) {
   char c;
   
   switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING:
+    case MPC_INPUT_MMAP:
+      return i->state.pos < i->length ? i->string[i->state.pos] : '\0';
+    
     case MPC_INPUT_FILE: 
       
       if (feof(i->file)) { return '\0'; }
@@ -520,16 +1167,11 @@ static char mpc_input_peekc(mpc_input_t *i) {
     
     case MPC_INPUT_PIPE:
       
+      if (mpc_input_buffer_in_range(i)) { return mpc_input_buffer_get(i); }
       if (feof(i->file)) { return '\0'; }
       
-      if (!i->buffer) { c = getc(i->file); ungetc(c, i->file); break; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        return mpc_input_buffer_get(i);
-      } else {
-        c = getc(i->file); ungetc(c, i->file);
-        break;
-      }
+      c = getc(i->file); ungetc(c, i->file);
+      break;
       
   }
   
@@ -541,16 +1183,11 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 
   switch (i->type) {
     case MPC_INPUT_STRING: break;
+    case MPC_INPUT_MMAP: break;
     case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); break;
     case MPC_INPUT_PIPE:
-      
-      if (!i->buffer) { ungetc(c, i->file); break; }
-      
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        break;
-      } else {
-        ungetc(c, i->file); 
-      }
+      if (!mpc_input_buffer_in_range(i)) { ungetc(c, i->file); }
+      break;
       
   }
   
@@ -560,25 +1197,23 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   
   if (i->type == MPC_INPUT_PIPE &&
-      i->buffer &&
+      i->marks_num > i->cut &&
       !mpc_input_buffer_in_range(i)) {
-    
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
+    mpc_input_buffer_push(i, c);
+  }
+  
+  if (i->state.pos == i->lines_upto &&
+      i->type != MPC_INPUT_STRING &&
+      i->type != MPC_INPUT_MMAP) {
+    if (c == '\n') { mpc_input_lines_push(i, i->state.pos); }
+    i->lines_upto++;
   }
   
   i->last = c;
   i->state.pos++;
-  i->state.col++;
-  
-  if (c == '\n') {
-    i->state.col = 0;
-    i->state.row++;
-  }
   
   if (o) {
-    (*o) = malloc(2);
+    (*o) = mpc_malloc(2);
     (*o)[0] = c;
     (*o)[1] = '\0';
   }
@@ -587,51 +1222,100 @@ static int mpc_input_success(mpc_input_t *i, char c, char **o) {
 }
 
 static int mpc_input_any(mpc_input_t *i, char **o) {
-  char x = mpc_input_getc(i);
-  if (mpc_input_terminated(i)) { return 0; }
+  char x;
+  if (!mpc_input_getc(i, &x)) { return 0; }
   return mpc_input_success(i, x, o);
 }
 
 static int mpc_input_char(mpc_input_t *i, char c, char **o) {
-  char x = mpc_input_getc(i);
-  if (mpc_input_terminated(i)) { return 0; }
+  char x;
+  if (!mpc_input_getc(i, &x)) { return 0; }
   return x == c ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
 }
 
 static int mpc_input_range(mpc_input_t *i, char c, char d, char **o) {
-  char x = mpc_input_getc(i);
-  if (mpc_input_terminated(i)) { return 0; }
+  char x;
+  if (!mpc_input_getc(i, &x)) { return 0; }
   return x >= c && x <= d ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
-static int mpc_input_oneof(mpc_input_t *i, const char *c, char **o) {
-  char x = mpc_input_getc(i);
-  if (mpc_input_terminated(i)) { return 0; }
-  return strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
+/*
+** Character classes are kept as 256 bit maps. As
+** with `strchr` the terminating zero counts as a
+** member of every class.
+*/
+
+#define MPC_CLASS_HAS(m, c) ((m)[(unsigned char)(c) >> 3] & (1 << ((unsigned char)(c) & 7)))
+#define MPC_CLASS_ADD(m, c) ((m)[(unsigned char)(c) >> 3] |= 1 << ((unsigned char)(c) & 7))
+
+static void mpc_class_build(unsigned char *m, const char *s) {
+  memset(m, 0, 32);
+  m[0] = 1;
+  while (*s) {
+    MPC_CLASS_ADD(m, *s);
+    s++;
+  }
+}
+
+static int mpc_input_oneof(mpc_input_t *i, const unsigned char *m, char **o) {
+  char x;
+  if (!mpc_input_getc(i, &x)) { return 0; }
+  return MPC_CLASS_HAS(m, x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
-static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
-  char x = mpc_input_getc(i);
-  if (mpc_input_terminated(i)) { return 0; }
-  return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
+static int mpc_input_noneof(mpc_input_t *i, const unsigned char *m, char **o) {
+  char x;
+  if (!mpc_input_getc(i, &x)) { return 0; }
+  return !MPC_CLASS_HAS(m, x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
-  char x = mpc_input_getc(i);
-  if (mpc_input_terminated(i)) { return 0; }
+  char x;
+  if (!mpc_input_getc(i, &x)) { return 0; }
   return cond(x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
-static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
-  
-  char *co = NULL;
-  const char *x = c;
-
+/*
+** Literals over in-memory input are compared in
+** one go and simply move the cursor along.
+*/
+
+static void mpc_input_advance(mpc_input_t *i, const char *c, int n) {
+  i->state.pos += n;
+  if (n > 0) { i->last = c[n-1]; }
+}
+
+static int mpc_input_string_memory(mpc_input_t *i, const char *c, int n) {
+  
+  int avail = i->length - i->state.pos;
+  
+  if (avail < n) {
+    if (i->partial && memcmp(i->string + i->state.pos, c, avail) == 0) { i->starved = 1; }
+    return 0;
+  }
+  
+  if (memcmp(i->string + i->state.pos, c, n) != 0) { return 0; }
+  
+  mpc_input_advance(i, c, n);
+  return 1;
+}
+
+static int mpc_input_string(mpc_input_t *i, const char *c, int n, char **o) {
+  
+  const char *x = c;
+  
+  if (i->type == MPC_INPUT_STRING || i->type == MPC_INPUT_MMAP) {
+    if (!mpc_input_string_memory(i, c, n)) { return 0; }
+    if (o) {
+      *o = mpc_malloc(n + 1);
+      memcpy(*o, c, n + 1);
+    }
+    return 1;
+  }
+
   mpc_input_mark(i);
   while (*x) {
-    if (mpc_input_char(i, *x, &co)) {
-      free(co);
-    } else {
+    if (!mpc_input_char(i, *x, NULL)) {
       mpc_input_rewind(i);
       return 0;
     }
@@ -639,8 +1323,10 @@ static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   }
   mpc_input_unmark(i);
   
-  *o = malloc(strlen(c) + 1);
-  strcpy(*o, c);
+  if (o) {
+    *o = mpc_malloc(n + 1);
+    strcpy(*o, c);
+  }
   return 1;
 }
 
@@ -680,7 +1366,13 @@ enum {
   MPC_TYPE_COUNT     = 22,
   
   MPC_TYPE_OR        = 23,
-  MPC_TYPE_AND       = 24
+  MPC_TYPE_AND       = 24,
+  
+  MPC_TYPE_MEMO      = 25,
+  MPC_TYPE_CODE      = 26,
+  
+  MPC_TYPE_CUT       = 27,
+  MPC_TYPE_DFA       = 28
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -690,14 +1382,18 @@ typedef struct { int(*f)(char,char); } mpc_pdata_anchor_t;
 typedef struct { char x; } mpc_pdata_single_t;
 typedef struct { char x; char y; } mpc_pdata_range_t;
 typedef struct { int(*f)(char); } mpc_pdata_satisfy_t;
-typedef struct { char *x; } mpc_pdata_string_t;
+typedef struct { char *x; int n; unsigned char m[32]; } mpc_pdata_string_t;
 typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;
 typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_to_t;
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
+typedef struct { mpc_parser_t *x; mpc_copy_t cp; mpc_dtor_t dx; } mpc_pdata_memo_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; unsigned char *first; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { int n; mpc_parser_t *code; mpc_parser_t **xs; mpc_dtor_t *dxs; char *strs; } mpc_pdata_code_t;
+typedef struct mpc_dfa_t mpc_dfa_t;
+typedef struct { mpc_parser_t *x; mpc_dfa_t *d; } mpc_pdata_dfa_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -711,25 +1407,239 @@ typedef union {
   mpc_pdata_apply_t apply;
   mpc_pdata_apply_to_t apply_to;
   mpc_pdata_predict_t predict;
+  mpc_pdata_memo_t memo;
   mpc_pdata_not_t not;
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_code_t code;
+  mpc_pdata_dfa_t dfa;
 } mpc_pdata_t;
 
+/*
+** Profiling
+**
+** Built with `MPC_PROFILE` every parser carries
+** a few counters which the machine bumps as it
+** goes. Time is inclusive and only measured for
+** the outermost activation of a parser, so deep
+** recursion is not counted more than once.
+**
+** Without the flag the hooks below are empty and
+** the parser type is exactly as it was.
+*/
+
+#ifdef MPC_PROFILE
+
+typedef struct {
+  unsigned long calls;
+  unsigned long passes;
+  unsigned long fails;
+  unsigned long backtracked;
+  double time;
+  double start;
+  int active;
+} mpc_profile_t;
+
+#endif
+
+/*
+** Marks say what `mpca_lang` built a node as, so
+** that parsing with events can walk the tree it
+** would have made without building it. A rule is
+** a named parser the grammar defines or refers to,
+** a token is a literal or regex it would make a
+** leaf of, with its tag just above it, and a tree
+** is a fold of the nodes below into one.
+*/
+
+enum {
+  MPC_MARK_RULE  = 1,
+  MPC_MARK_TAG   = 2,
+  MPC_MARK_TOKEN = 4,
+  MPC_MARK_TREE  = 8
+};
+
 struct mpc_parser_t {
   char retained;
   char *name;
   char type;
+  char mark;
   mpc_pdata_t data;
+#ifdef MPC_PROFILE
+  mpc_profile_t profile;
+#endif
 };
 
+#ifdef MPC_PROFILE
+
+static double mpc_profile_now(void) {
+#if defined(__unix__) || defined(__APPLE__)
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + (double)t.tv_nsec / 1e9;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static void mpc_profile_reset(mpc_parser_t *p) {
+  memset(&p->profile, 0, sizeof(mpc_profile_t));
+}
+
+static void mpc_profile_enter(mpc_parser_t *p) {
+  p->profile.calls++;
+  if (p->profile.active++ == 0) { p->profile.start = mpc_profile_now(); }
+}
+
+static void mpc_profile_leave(mpc_parser_t *p, int passed) {
+  if (passed) { p->profile.passes++; } else { p->profile.fails++; }
+  if (p->profile.active > 0 && --p->profile.active == 0) {
+    p->profile.time += mpc_profile_now() - p->profile.start;
+  }
+}
+
+static void mpc_profile_rewind(mpc_parser_t *p, mpc_input_t *i) {
+  if (i->backtrack < 1) { return; }
+  p->profile.backtracked += i->state.pos - i->marks[i->marks_num-1].pos;
+}
+
+#define MPC_PROFILE_ENTER(p) mpc_profile_enter(p)
+#define MPC_PROFILE_LEAVE(s, p) mpc_profile_leave(p, (s)->returns[(s)->results_num-1] != MPC_RESULT_ERROR)
+#define MPC_PROFILE_REWIND(p, i) mpc_profile_rewind(p, i)
+
+#else
+
+#define MPC_PROFILE_ENTER(p)
+#define MPC_PROFILE_LEAVE(s, p)
+#define MPC_PROFILE_REWIND(p, i)
+
+#endif
+
 /*
 ** Stack Type
+**
+** Each result is either an error, an output or,
+** when the input can be randomly accessed, a
+** span. Spans just record where some matched
+** text starts and how long it is. Primitives
+** produce them instead of tiny strings, and a
+** fold with `mpcf_strfold` over adjacent spans
+** simply yields a wider span. A span is only
+** copied out into a real string once something
+** else wants to look at it.
+**
+** A stack may also run quietly. Then failures
+** are pushed as a NULL error and nothing at all
+** is spent on building or merging messages, as
+** most failures are thrown away again by some
+** enclosing `or` or `many`. All that is kept is
+** the farthest position anything failed at and
+** what was expected there, and should the parse
+** as a whole fail its error is made from that.
+** Nothing is noted inside an `expect`, which on
+** failing notes its own description instead, so
+** the message is much as a loud one would be.
+*/
+
+#define MPC_FAR_MAX 16
+
+enum {
+  MPC_RESULT_ERROR  = 0,
+  MPC_RESULT_OUTPUT = 1,
+  MPC_RESULT_SPAN   = 2
+};
+
+typedef struct {
+  int pos;
+  int len;
+} mpc_span_t;
+
+/*
+** Packrat Memo
+**
+** A parser wrapped with `mpc_memo` remembers the
+** result it gave at each position, so when some
+** failed alternative is retried from that spot
+** the answer is replayed rather than worked out
+** again. The table is direct mapped, so a
+** colliding entry just evicts the old one, and
+** is sized to the input up to a fixed bound, so
+** memory use stays bounded.
+*/
+
+#define MPC_MEMO_SLOTS 1024
+#define MPC_MEMO_MAX   (1 << 20)
+
+typedef struct {
+  mpc_parser_t *p;
+  int pos;
+  int end;
+  char last;
+  int kind;
+  mpc_span_t span;
+  mpc_result_t result;
+} mpc_memo_t;
+
+/*
+** Events
+**
+** A stack given an event log reports rules and
+** tokens to callbacks rather than have anything
+** build a tree. Any event might still be taken
+** back by a backtrack, so they are logged first
+** and only handed on once nothing is left which
+** could go back past them. That is when no mark
+** or rule is open any more, or at a cut.
+**
+** Every mark and every rule entered saves how
+** long the log was. Rewinding to the mark, or
+** the rule failing, cuts the log back to that.
 */
 
+enum {
+  MPC_EVENT_ENTER = 0,
+  MPC_EVENT_LEAVE = 1,
+  MPC_EVENT_TOKEN = 2
+};
+
+typedef struct {
+  int type;
+  const char *name;
+  int pos;
+  int len;
+  int text;
+} mpc_event_t;
+
+typedef struct {
+  
+  const mpc_events_t *f;
+  void *d;
+  
+  int base;
+  int num;
+  int slots;
+  mpc_event_t *log;
+  
+  int saves_num;
+  int saves_slots;
+  int *saves;
+  
+  int text_num;
+  int text_slots;
+  char *text;
+  
+} mpc_event_log_t;
+
 typedef struct {
 
+  mpc_input_t *input;
+  int spanned;
+  int quiet;
+  int committed;
+  
+  mpc_event_log_t *events;
+
   int parsers_num;
   int parsers_slots;
   mpc_parser_t **parsers;
@@ -739,13 +1649,39 @@ typedef struct {
   int results_slots;
   mpc_result_t *results;
   int *returns;
+  mpc_span_t *spans;
+  
+  mpc_memo_t *memo;
+  int memo_slots;
   
   mpc_err_t *err;
   
+  int far_pos;
+  int far_num;
+  int far_depth;
+  const char *far_failure;
+  const char *far_expected[MPC_FAR_MAX];
+  int far_dfa_num;
+  int far_dfa_at[MPC_FAR_MAX];
+  mpc_parser_t *far_dfa[MPC_FAR_MAX];
+  
 } mpc_stack_t;
 
-static mpc_stack_t *mpc_stack_new(const char *filename) {
-  mpc_stack_t *s = malloc(sizeof(mpc_stack_t));
+/*
+** The stack's arrays only ever grow, to the
+** deepest point any parse has reached, so a
+** stack which is reused for many parses soon
+** stops allocating at all. `mpc_stack_trim`
+** hands the memory back explicitly.
+*/
+
+static void mpc_stack_init(mpc_stack_t *s) {
+  
+  s->input = NULL;
+  s->spanned = 0;
+  s->quiet = 0;
+  s->committed = 0;
+  s->events = NULL;
   
   s->parsers_num = 0;
   s->parsers_slots = 0;
@@ -756,37 +1692,358 @@ static mpc_stack_t *mpc_stack_new(const char *filename) {
   s->results_slots = 0;
   s->results = NULL;
   s->returns = NULL;
+  s->spans = NULL;
   
-  s->err = mpc_err_fail(filename, mpc_state_invalid(), "Unknown Error");
+  s->memo = NULL;
+  s->memo_slots = 0;
+  s->err = NULL;
   
-  return s;
+  s->far_pos = -1;
+  s->far_num = 0;
+  s->far_depth = 0;
+  s->far_failure = NULL;
+  s->far_dfa_num = 0;
+  
+}
+
+/*
+** Only in-memory input can be parsed quietly as
+** its error is made from positions in the input.
+*/
+
+static void mpc_stack_begin(mpc_stack_t *s, mpc_input_t *i, int quiet) {
+  
+  s->input = i;
+  s->spanned = i->type == MPC_INPUT_STRING || i->type == MPC_INPUT_MMAP;
+  s->quiet = quiet && s->spanned;
+  s->committed = 0;
+  
+#ifdef MPC_PROFILE
+  /* Frames abandoned by an earlier parse never left */
+  while (s->parsers_num > 0) { s->parsers[--s->parsers_num]->profile.active = 0; }
+#endif
+  
+  s->parsers_num = 0;
+  s->results_num = 0;
+  
+  if (s->events) {
+    s->events->base = 0;
+    s->events->num = 0;
+    s->events->saves_num = 0;
+    s->events->text_num = 0;
+  }
+  
+  s->err = s->quiet ? NULL : mpc_err_fail(i->filename, mpc_state_invalid(), "Unknown Error");
+  s->far_pos = -1;
+  s->far_num = 0;
+  s->far_depth = 0;
+  s->far_failure = NULL;
+  s->far_dfa_num = 0;
+  
+}
+
+static void mpc_stack_span_out(mpc_stack_t *s, int k) {
+  
+  mpc_span_t *x = &s->spans[k];
+  char *y;
+  
+  if (s->returns[k] != MPC_RESULT_SPAN) { return; }
+  
+  y = mpc_malloc(x->len + 1);
+  memcpy(y, s->input->string + x->pos, x->len);
+  y[x->len] = '\0';
+  
+  s->results[k].output = y;
+  s->returns[k] = MPC_RESULT_OUTPUT;
 }
 
 static void mpc_stack_err(mpc_stack_t *s, mpc_err_t* e) {
   mpc_err_t *errs[2];
+  if (s->quiet) { return; }
   errs[0] = s->err;
   errs[1] = e;
   s->err = mpc_err_or(errs, 2);
 }
 
+/* Whether a quiet failure at `pos` is to be noted, forgetting any before it */
+static int mpc_stack_far_at(mpc_stack_t *s, int pos) {
+  
+  if (s->far_depth > 0 || pos < s->far_pos) { return 0; }
+  
+  if (pos > s->far_pos) {
+    s->far_pos = pos;
+    s->far_num = 0;
+    s->far_failure = NULL;
+    s->far_dfa_num = 0;
+  }
+  
+  return 1;
+}
+
+static void mpc_stack_far_add(mpc_stack_t *s, const char *expected, const char *failure) {
+  
+  int k;
+  
+  if (failure) {
+    if (s->far_failure == NULL) { s->far_failure = failure; }
+    return;
+  }
+  
+  for (k = 0; k < s->far_num; k++) {
+    if (strcmp(s->far_expected[k], expected) == 0) { return; }
+  }
+  if (s->far_num < MPC_FAR_MAX) { s->far_expected[s->far_num++] = expected; }
+}
+
+static void mpc_stack_far(mpc_stack_t *s, const char *expected, const char *failure) {
+  if (mpc_stack_far_at(s, s->input->state.pos)) { mpc_stack_far_add(s, expected, failure); }
+}
+
+/* An automaton failing at `stop` says nothing of what it expected, so its regex is kept to ask later */
+static void mpc_stack_far_dfa(mpc_stack_t *s, mpc_parser_t *x, int stop) {
+  if (!mpc_stack_far_at(s, stop) || s->far_dfa_num == MPC_FAR_MAX) { return; }
+  s->far_dfa_at[s->far_dfa_num] = s->input->state.pos;
+  s->far_dfa[s->far_dfa_num++] = x;
+}
+
+static mpc_err_t *mpc_stack_far_err(mpc_stack_t *s) {
+  
+  mpc_input_t *i = s->input;
+  mpc_err_t *e;
+  int k;
+  
+  if (s->far_failure) {
+    return mpc_err_fail(i->filename, mpc_input_state_at(i, s->far_pos), s->far_failure);
+  }
+  
+  if (s->far_num == 0) {
+    return mpc_err_fail(i->filename, mpc_state_invalid(), "Unknown Error");
+  }
+  
+  e = mpc_err_new(i->filename, mpc_input_state_at(i, s->far_pos), s->far_expected[0],
+    s->far_pos < i->length ? i->string[s->far_pos] : '\0');
+  for (k = 1; k < s->far_num; k++) { mpc_err_add_expected(e, (char*)s->far_expected[k]); }
+  return e;
+}
+
+/* Event Log Stuff */
+
+static void mpc_stack_events_save(mpc_stack_t *s) {
+  mpc_event_log_t *e = s->events;
+  if (e->saves_num == e->saves_slots) {
+    e->saves_slots = e->saves_slots ? e->saves_slots * 2 : 64;
+    e->saves = realloc(e->saves, sizeof(int) * e->saves_slots);
+  }
+  e->saves[e->saves_num++] = e->base + e->num;
+}
+
+static void mpc_stack_events_push(mpc_stack_t *s, int type, const char *name, int pos, const char *text, int len) {
+  
+  mpc_event_log_t *e = s->events;
+  mpc_event_t *x;
+  
+  if (e->num == e->slots) {
+    e->slots = e->slots ? e->slots * 2 : 64;
+    e->log = realloc(e->log, sizeof(mpc_event_t) * e->slots);
+  }
+  
+  x = &e->log[e->num++];
+  x->type = type;
+  x->name = name;
+  x->pos = pos;
+  x->len = len;
+  x->text = e->text_num;
+  
+  if (text == NULL) { return; }
+  
+  while (e->text_num + len + 1 > e->text_slots) {
+    e->text_slots = e->text_slots ? e->text_slots * 2 : 256;
+    e->text = realloc(e->text, e->text_slots);
+  }
+  
+  memcpy(e->text + e->text_num, text, len);
+  e->text[e->text_num + len] = '\0';
+  e->text_num += len + 1;
+}
+
+/* Hands on everything logged so far */
+
+static void mpc_stack_events_flush(mpc_stack_t *s) {
+  
+  mpc_event_log_t *e = s->events;
+  const mpc_events_t *f = e->f;
+  mpc_event_t *x;
+  int k;
+  
+  for (k = 0; k < e->num; k++) {
+    x = &e->log[k];
+    switch (x->type) {
+      case MPC_EVENT_ENTER:
+        if (f->enter) { f->enter(e->d, x->name, mpc_input_state_at(s->input, x->pos)); }
+        break;
+      case MPC_EVENT_LEAVE:
+        if (f->leave) { f->leave(e->d, x->name, mpc_input_state_at(s->input, x->pos)); }
+        break;
+      case MPC_EVENT_TOKEN:
+        if (f->token) { f->token(e->d, x->name, e->text + x->text, x->len, mpc_input_state_at(s->input, x->pos)); }
+        break;
+    }
+  }
+  
+  e->base += e->num;
+  e->num = 0;
+  e->text_num = 0;
+}
+
+/* What has already been handed on can't be taken back */
+
+static void mpc_stack_events_undo(mpc_stack_t *s) {
+  mpc_event_log_t *e = s->events;
+  int k = e->saves[--e->saves_num] - e->base;
+  if (k < 0) { k = 0; }
+  if (k < e->num) {
+    e->text_num = e->log[k].text;
+    e->num = k;
+  }
+}
+
+static void mpc_stack_events_keep(mpc_stack_t *s) {
+  mpc_event_log_t *e = s->events;
+  e->saves_num--;
+  if (e->saves_num == 0) { mpc_stack_events_flush(s); }
+}
+
+static void mpc_stack_events_enter(mpc_stack_t *s, mpc_parser_t *p) {
+  mpc_stack_events_save(s);
+  mpc_stack_events_push(s, MPC_EVENT_ENTER, p->name, s->input->state.pos, NULL, 0);
+}
+
+static void mpc_stack_events_leave(mpc_stack_t *s, mpc_parser_t *p) {
+  if (s->returns[s->results_num-1] == MPC_RESULT_ERROR) {
+    mpc_stack_events_undo(s);
+  } else {
+    mpc_stack_events_push(s, MPC_EVENT_LEAVE, p->name, s->input->state.pos, NULL, 0);
+    mpc_stack_events_keep(s);
+  }
+}
+
+#define MPC_EVENTS_LEAVE(s, p) if ((s)->events && ((p)->mark & MPC_MARK_RULE)) { mpc_stack_events_leave(s, p); }
+
+static void mpc_stack_mark(mpc_stack_t *s, mpc_input_t *i) {
+  mpc_input_mark(i);
+  if (s->events) { mpc_stack_events_save(s); }
+}
+
+static void mpc_stack_unmark(mpc_stack_t *s, mpc_input_t *i) {
+  mpc_input_unmark(i);
+  if (s->events) { mpc_stack_events_keep(s); }
+}
+
+/*
+** Cut
+**
+** A cut commits to the path taken so far. Every
+** mark held is given up, so pipe input can drop
+** what it buffered, and errors from alternatives
+** already tried are forgotten.
+**
+** If something then fails and would need to go
+** back past the cut the stack is `committed` and
+** the parse is over. Failures are handed up with
+** no more alternatives or repeats tried. Where a
+** repeat has already built some results it still
+** returns them, so the sequence or count above it,
+** which knows how to delete them, is the one to
+** fail. At the very top there is nothing to do so
+** and the repeat's result is returned as it is.
+*/
+
+static void mpc_stack_cut(mpc_stack_t *s, mpc_input_t *i) {
+  mpc_input_cut(i);
+  if (s->events) { mpc_stack_events_flush(s); }
+  s->far_pos = -1;
+  s->far_num = 0;
+  s->far_failure = NULL;
+  s->far_dfa_num = 0;
+  if (s->quiet) { return; }
+  mpc_err_delete(s->err);
+  s->err = mpc_err_fail(i->filename, mpc_state_invalid(), "Unknown Error");
+}
+
+static void mpc_stack_rewind(mpc_stack_t *s, mpc_input_t *i) {
+  if (!mpc_input_rewind(i)) { s->committed = 1; }
+  if (s->events) { mpc_stack_events_undo(s); }
+}
+
+static mpc_err_t *mpc_stack_committed_err(mpc_stack_t *s) {
+  return s->quiet ? NULL : mpc_err_fail(s->input->filename, mpc_state_invalid(), "Unknown Error");
+}
+
+static void mpc_memo_clear(mpc_memo_t *m) {
+  if (m->p == NULL) { return; }
+  if (m->kind == MPC_RESULT_ERROR && m->result.error) { mpc_err_delete(m->result.error); }
+  if (m->kind == MPC_RESULT_OUTPUT && m->result.output && m->p->data.memo.dx) {
+    m->p->data.memo.dx(m->result.output);
+  }
+  m->p = NULL;
+}
+
+/* A table grown for some large input is dropped, so later small parses need not clear it */
+static void mpc_stack_memo_clear(mpc_stack_t *s) {
+  int k;
+  if (s->memo == NULL) { return; }
+  for (k = 0; k < s->memo_slots; k++) { mpc_memo_clear(&s->memo[k]); }
+  if (s->memo_slots > MPC_MEMO_SLOTS) {
+    free(s->memo);
+    s->memo = NULL;
+  }
+}
+
+static mpc_memo_t *mpc_stack_memo_slot(mpc_stack_t *s, mpc_parser_t *p, int pos) {
+  return &s->memo[((size_t)p / sizeof(mpc_parser_t) * 31 + (size_t)pos) & (s->memo_slots - 1)];
+}
+
+static mpc_memo_t *mpc_stack_memo_find(mpc_stack_t *s, mpc_parser_t *p, int pos) {
+  mpc_memo_t *m;
+  if (s->memo == NULL) { return NULL; }
+  m = mpc_stack_memo_slot(s, p, pos);
+  return (m->p == p && m->pos == pos) ? m : NULL;
+}
+
 static int mpc_stack_terminate(mpc_stack_t *s, mpc_result_t *r) {
-  int success = s->returns[0];
+  int success;
+  
+  mpc_stack_span_out(s, 0);
+  success = s->returns[0];
   
   if (success) {
     r->output = s->results[0].output;
-    mpc_err_delete(s->err);
+    if (s->err) { mpc_err_delete(s->err); }
+  } else if (s->quiet) {
+    r->error = mpc_stack_far_err(s);
   } else {
     mpc_stack_err(s, s->results[0].error);
     r->error = s->err;
   }
   
+  s->err = NULL;
+  s->results_num = 0;
+  mpc_stack_memo_clear(s);
+  
+  return success;
+}
+
+static void mpc_stack_trim(mpc_stack_t *s) {
+  
   free(s->parsers);
   free(s->states);
   free(s->results);
   free(s->returns);
-  free(s);
+  free(s->spans);
+  mpc_stack_memo_clear(s);
+  free(s->memo);
   
-  return success;
+  mpc_stack_init(s);
 }
 
 /* Stack Parser Stuff */
@@ -797,15 +2054,7 @@ static void mpc_stack_set_state(mpc_stack_t *s, int x) {
 
 static void mpc_stack_parsers_reserve_more(mpc_stack_t *s) {
   if (s->parsers_num > s->parsers_slots) {
-    s->parsers_slots = ceil((s->parsers_slots+1) * 1.5);
-    s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
-    s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
-  }
-}
-
-static void mpc_stack_parsers_reserve_less(mpc_stack_t *s) {
-  if (s->parsers_slots > pow(s->parsers_num+1, 1.5)) {
-    s->parsers_slots = floor((s->parsers_slots-1) * (1.0/1.5));
+    s->parsers_slots = s->parsers_slots ? s->parsers_slots * 2 : 64;
     s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
     s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
   }
@@ -816,13 +2065,14 @@ static void mpc_stack_pushp(mpc_stack_t *s, mpc_parser_t *p) {
   mpc_stack_parsers_reserve_more(s);
   s->parsers[s->parsers_num-1] = p;
   s->states[s->parsers_num-1] = 0;
+  if (s->events && (p->mark & MPC_MARK_RULE)) { mpc_stack_events_enter(s, p); }
+  MPC_PROFILE_ENTER(p);
 }
 
 static void mpc_stack_popp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
   *p = s->parsers[s->parsers_num-1];
   *st = s->states[s->parsers_num-1];
   s->parsers_num--;
-  mpc_stack_parsers_reserve_less(s);
 }
 
 static void mpc_stack_peepp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
@@ -850,17 +2100,10 @@ static mpc_result_t mpc_result_out(mpc_val_t *x) {
 
 static void mpc_stack_results_reserve_more(mpc_stack_t *s) {
   if (s->results_num > s->results_slots) {
-    s->results_slots = ceil((s->results_slots + 1) * 1.5);
-    s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
-    s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
-  }
-}
-
-static void mpc_stack_results_reserve_less(mpc_stack_t *s) {
-  if ( s->results_slots > pow(s->results_num+1, 1.5)) {
-    s->results_slots = floor((s->results_slots-1) * (1.0/1.5));
+    s->results_slots = s->results_slots ? s->results_slots * 2 : 64;
     s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
     s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
+    s->spans = realloc(s->spans, sizeof(mpc_span_t) * s->results_slots);
   }
 }
 
@@ -871,34 +2114,149 @@ static void mpc_stack_pushr(mpc_stack_t *s, mpc_result_t x, int r) {
   s->returns[s->results_num-1] = r;
 }
 
-static int mpc_stack_popr(mpc_stack_t *s, mpc_result_t *x) {
+static void mpc_stack_pushs(mpc_stack_t *s, int pos, int len) {
+  s->results_num++;
+  mpc_stack_results_reserve_more(s);
+  s->returns[s->results_num-1] = MPC_RESULT_SPAN;
+  s->spans[s->results_num-1].pos = pos;
+  s->spans[s->results_num-1].len = len;
+}
+
+static void mpc_stack_lift(mpc_stack_t *s, mpc_ctor_t lf) {
+  if (s->spanned && lf == mpcf_ctor_str) {
+    mpc_stack_pushs(s, s->input->state.pos, 0);
+  } else {
+    mpc_stack_pushr(s, mpc_result_out(lf()), MPC_RESULT_OUTPUT);
+  }
+}
+
+static int mpc_stack_dropr(mpc_stack_t *s, mpc_result_t *x) {
   int r;
   *x = s->results[s->results_num-1];
   r = s->returns[s->results_num-1];
   s->results_num--;
-  mpc_stack_results_reserve_less(s);
   return r;
 }
 
+static int mpc_stack_popr(mpc_stack_t *s, mpc_result_t *x) {
+  mpc_stack_span_out(s, s->results_num-1);
+  return mpc_stack_dropr(s, x);
+}
+
 static int mpc_stack_peekr(mpc_stack_t *s, mpc_result_t *x) {
   *x = s->results[s->results_num-1];
   return s->returns[s->results_num-1];
 }
 
-static void mpc_stack_popr_err(mpc_stack_t *s, int n) {
-  mpc_result_t x;
-  while (n) {
-    mpc_stack_popr(s, &x);
-    mpc_stack_err(s, x.error);
-    n--;
-  }
-}
+/*
+** Logs the token on top in place of the node
+** `mpcf_str_ast` would have made of it. If the
+** frame above is its tag the token gets it,
+** otherwise it has none, just as a node.
+*/
+
+static void mpc_stack_events_token(mpc_stack_t *s, int pos) {
+  
+  mpc_parser_t *q = s->parsers_num > 1 ? s->parsers[s->parsers_num-2] : NULL;
+  const char *tag = "";
+  mpc_span_t y;
+  mpc_result_t r;
+  
+  if (q && (q->mark & MPC_MARK_TAG)) {
+    tag = q->data.apply_to.d;
+  }
+  
+  if (mpc_stack_peekr(s, &r) == MPC_RESULT_SPAN) {
+    y = s->spans[s->results_num-1];
+    mpc_stack_events_push(s, MPC_EVENT_TOKEN, tag, pos, s->input->string + y.pos, y.len);
+  } else if (r.output) {
+    mpc_stack_events_push(s, MPC_EVENT_TOKEN, tag, pos, r.output, strlen(r.output));
+    mpc_free(r.output);
+  }
+  
+  s->results_num--;
+}
+
+/*
+** Records the top result as the answer `p` gives
+** at `pos`. Outputs are only kept when there is
+** a way to copy them, as the original carries on
+** up the stack to be consumed. The copy may just
+** share it, as `mpc_ast_retain` does, so outputs
+** which matched nothing are not kept, as those
+** alone could be replayed twice into one result.
+*/
+
+static void mpc_stack_memo_store(mpc_stack_t *s, mpc_parser_t *p, int pos) {
+  
+  mpc_memo_t *m;
+  mpc_result_t r;
+  int kind = mpc_stack_peekr(s, &r);
+  
+  if (kind == MPC_RESULT_OUTPUT && r.output
+  && (p->data.memo.cp == NULL || s->input->state.pos == pos)) { return; }
+  
+  if (s->memo == NULL) {
+    s->memo_slots = MPC_MEMO_SLOTS;
+    while (s->memo_slots < 2 * s->input->length && s->memo_slots < MPC_MEMO_MAX) { s->memo_slots *= 2; }
+    s->memo = calloc(s->memo_slots, sizeof(mpc_memo_t));
+  }
+  
+  m = mpc_stack_memo_slot(s, p, pos);
+  mpc_memo_clear(m);
+  
+  m->p = p;
+  m->pos = pos;
+  m->end = s->input->state.pos;
+  m->last = s->input->last;
+  m->kind = kind;
+  
+  switch (kind) {
+    case MPC_RESULT_ERROR:  m->result.error = r.error ? mpc_err_copy(r.error) : NULL; break;
+    case MPC_RESULT_SPAN:   m->span = s->spans[s->results_num-1]; break;
+    case MPC_RESULT_OUTPUT: m->result.output = r.output ? p->data.memo.cp(r.output) : NULL; break;
+  }
+  
+}
+
+static void mpc_stack_memo_replay(mpc_stack_t *s, mpc_memo_t *m) {
+  
+  s->input->state.pos = m->end;
+  s->input->last = m->last;
+  
+  switch (m->kind) {
+    case MPC_RESULT_ERROR:
+      mpc_stack_pushr(s, mpc_result_err(m->result.error ? mpc_err_copy(m->result.error) : NULL), MPC_RESULT_ERROR);
+      break;
+    case MPC_RESULT_SPAN:
+      mpc_stack_pushs(s, m->span.pos, m->span.len);
+      break;
+    case MPC_RESULT_OUTPUT:
+      mpc_stack_pushr(s, mpc_result_out(m->result.output ? m->p->data.memo.cp(m->result.output) : NULL), MPC_RESULT_OUTPUT);
+      break;
+  }
+  
+}
+
+/* Removes the `n` errors sitting under the top result */
+static void mpc_stack_popr_err_under(mpc_stack_t *s, int n) {
+  
+  int k, top = s->results_num-1;
+  
+  for (k = top-n; k < top; k++) {
+    mpc_stack_err(s, s->results[k].error);
+  }
+  
+  s->results[top-n] = s->results[top];
+  s->returns[top-n] = s->returns[top];
+  s->spans[top-n] = s->spans[top];
+  s->results_num -= n;
+}
 
 static void mpc_stack_popr_out(mpc_stack_t *s, int n, mpc_dtor_t *ds) {
   mpc_result_t x;
   while (n) {
-    mpc_stack_popr(s, &x);
-    ds[n-1](x.output);
+    if (mpc_stack_dropr(s, &x) != MPC_RESULT_SPAN) { ds[n-1](x.output); }
     n--;
   }
 }
@@ -906,8 +2264,7 @@ static void mpc_stack_popr_out(mpc_stack_t *s, int n, mpc_dtor_t *ds) {
 static void mpc_stack_popr_out_single(mpc_stack_t *s, int n, mpc_dtor_t dx) {
   mpc_result_t x;
   while (n) {
-    mpc_stack_popr(s, &x);
-    dx(x.output);
+    if (mpc_stack_dropr(s, &x) != MPC_RESULT_SPAN) { dx(x.output); }
     n--;
   }
 }
@@ -915,23 +2272,648 @@ static void mpc_stack_popr_out_single(mpc_stack_t *s, int n, mpc_dtor_t dx) {
 static void mpc_stack_popr_n(mpc_stack_t *s, int n) {
   mpc_result_t x;
   while (n) {
-    mpc_stack_popr(s, &x);
+    mpc_stack_dropr(s, &x);
     n--;
   }
 }
 
-static mpc_val_t *mpc_stack_merger_out(mpc_stack_t *s, int n, mpc_fold_t f) {
-  mpc_val_t *x = f(n, (mpc_val_t**)(&s->results[s->results_num-n]));
+static int mpc_stack_spans_adjacent(mpc_stack_t *s, int n, mpc_span_t *y) {
+  
+  int k;
+  
+  y->pos = s->input->state.pos;
+  y->len = 0;
+  
+  for (k = s->results_num-n; k < s->results_num; k++) {
+    if (s->returns[k] != MPC_RESULT_SPAN) { return 0; }
+    if (s->spans[k].len == 0) { continue; }
+    if (y->len == 0) { *y = s->spans[k]; continue; }
+    if (s->spans[k].pos != y->pos + y->len) { return 0; }
+    y->len += s->spans[k].len;
+  }
+  
+  return 1;
+}
+
+static int mpc_nth_fold(mpc_fold_t f, int *freeing) {
+  *freeing = 0;
+  if (f == mpcf_fst) { return 0; }
+  if (f == mpcf_snd) { return 1; }
+  if (f == mpcf_trd) { return 2; }
+  *freeing = 1;
+  if (f == mpcf_fst_free) { return 0; }
+  if (f == mpcf_snd_free) { return 1; }
+  if (f == mpcf_trd_free) { return 2; }
+  return -1;
+}
+
+/*
+** Folds the top `n` results into a single one.
+** Spans are kept as spans where the fold allows
+** it and only turned into strings otherwise.
+*/
+
+static int mpc_stack_outputs_null(mpc_stack_t *s, int n) {
+  int k;
+  for (k = s->results_num-n; k < s->results_num; k++) {
+    if (s->returns[k] != MPC_RESULT_OUTPUT || s->results[k].output) { return 0; }
+  }
+  return 1;
+}
+
+static void mpc_stack_merger_out(mpc_stack_t *s, int n, mpc_fold_t f, int tree) {
+  
+  int k, x, freeing, base = s->results_num-n;
+  mpc_span_t y;
+  mpc_val_t *out;
+  
+  /* With events on a tree of nothing is nothing too */
+  if (s->events && tree && mpc_stack_outputs_null(s, n)) {
+    mpc_stack_popr_n(s, n);
+    mpc_stack_pushr(s, mpc_result_out(NULL), MPC_RESULT_OUTPUT);
+    return;
+  }
+  
+  if (s->spanned) {
+    
+    if (f == mpcf_strfold && mpc_stack_spans_adjacent(s, n, &y)) {
+      mpc_stack_popr_n(s, n);
+      mpc_stack_pushs(s, y.pos, y.len);
+      return;
+    }
+    
+    x = mpc_nth_fold(f, &freeing);
+    if (x >= 0 && x < n && s->returns[base+x] == MPC_RESULT_SPAN) {
+      y = s->spans[base+x];
+      for (k = 0; k < n; k++) {
+        if (k != x && freeing && s->returns[base+k] == MPC_RESULT_OUTPUT) {
+          mpc_free(s->results[base+k].output);
+        }
+      }
+      mpc_stack_popr_n(s, n);
+      mpc_stack_pushs(s, y.pos, y.len);
+      return;
+    }
+    
+    for (k = base; k < s->results_num; k++) { mpc_stack_span_out(s, k); }
+  }
+  
+  out = f(n, (mpc_val_t**)(&s->results[base]));
   mpc_stack_popr_n(s, n);
-  return x;
+  mpc_stack_pushr(s, mpc_result_out(out), MPC_RESULT_OUTPUT);
+}
+
+/* A FIRST set is a class followed by a flag for matching empty */
+
+#define MPC_FIRST_SIZE 33
+#define MPC_FIRST_NULLABLE 32
+
+/*
+** Skips past the alternatives of `p` from `k` on
+** which the FIRST sets say cannot match the next
+** byte, pushing an empty error for each one. At
+** the end of partial input anything might still
+** match so nothing is skipped.
+*/
+
+static int mpc_stack_or_skip(mpc_stack_t *s, mpc_parser_t *p, int k) {
+  
+  mpc_input_t *i = s->input;
+  unsigned char *f = p->data.or.first, *x;
+  int j = k, end;
+  unsigned char c = 0;
+  
+  if (!s->quiet || f == NULL) { return 0; }
+  
+  end = i->state.pos >= i->length;
+  if (end && i->partial) { return 0; }
+  if (!end) { c = i->string[i->state.pos]; }
+  
+  while (j < p->data.or.n) {
+    x = f + j * MPC_FIRST_SIZE;
+    if (x[MPC_FIRST_NULLABLE] || (!end && MPC_CLASS_HAS(x, c))) { break; }
+    mpc_stack_pushr(s, mpc_result_err(NULL), MPC_RESULT_ERROR);
+    j++;
+  }
+  
+  return j - k;
 }
 
 static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
-  mpc_err_t *x = mpc_err_or((mpc_err_t**)(&s->results[s->results_num-n]), n);
+  mpc_err_t *x = s->quiet ? NULL : mpc_err_or((mpc_err_t**)(&s->results[s->results_num-n]), n);
   mpc_stack_popr_n(s, n);
   return x;
 }
 
+/*
+** A character class repeated and folded with
+** `mpcf_strfold` is scanned in a single tight
+** loop over in-memory input and comes out as one
+** span. The class may be wrapped in an `expect`,
+** which is how `mpc_oneof` and friends build it.
+*/
+
+static mpc_parser_t *mpc_class_of(mpc_parser_t *x) {
+  if (x->type == MPC_TYPE_EXPECT) { x = x->data.expect.x; }
+  switch (x->type) {
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_RANGE:
+      return x;
+    default:
+      return NULL;
+  }
+}
+
+/* Returns the length of the run, or -1 if a partial input ran dry */
+static int mpc_input_class_run(mpc_input_t *i, mpc_parser_t *c) {
+  
+  const char *s = i->string + i->state.pos;
+  const unsigned char *m = c->data.string.m;
+  int k = 0, n = i->length - i->state.pos;
+  char lo, hi;
+  
+  switch (c->type) {
+    case MPC_TYPE_ONEOF:  while (k < n &&  MPC_CLASS_HAS(m, s[k])) { k++; } break;
+    case MPC_TYPE_NONEOF: while (k < n && !MPC_CLASS_HAS(m, s[k])) { k++; } break;
+    case MPC_TYPE_RANGE:
+      lo = c->data.range.x;
+      hi = c->data.range.y;
+      while (k < n && s[k] >= lo && s[k] <= hi) { k++; }
+      break;
+  }
+  
+  if (k == n && i->partial) { i->starved = 1; return -1; }
+  
+  mpc_input_advance(i, s, k);
+  return k;
+}
+
+/* The error the repeated parser would have given at the end of the run */
+static mpc_err_t *mpc_class_err(mpc_input_t *i, mpc_parser_t *x) {
+  if (x->type == MPC_TYPE_EXPECT) {
+    return mpc_err_new(i->filename, mpc_input_state(i), x->data.expect.m, mpc_input_peekc(i));
+  }
+  return mpc_err_fail(i->filename, mpc_input_state(i), "Incorrect Input");
+}
+
+static void mpc_stack_far_class(mpc_stack_t *s, mpc_parser_t *x) {
+  if (x->type == MPC_TYPE_EXPECT) {
+    mpc_stack_far(s, x->data.expect.m, NULL);
+  } else {
+    mpc_stack_far(s, NULL, "Incorrect Input");
+  }
+}
+
+/*
+** Regex Automata
+**
+** Regexes which `mpc_re` can compile are turned into
+** an NFA of single character steps and a DFA whose
+** states are sets of NFA states. A counted repeat
+** must not be followed by one more of the same, so
+** some NFA steps are guards which can only be taken
+** if the next character isn't in their class. So a
+** DFA state matches or not depending on the next
+** character, or the end of the input.
+**
+** State zero of a DFA is the empty set, and dead,
+** and state one is the start. Bytes are mapped to
+** classes which all behave the same so rows stay
+** short.
+**
+** Small DFAs are built in full when the regex is
+** compiled, and matching just walks the table. For
+** the rest states are built as they are first
+** reached, up to a budget of memory. When it runs
+** out the states are all thrown away and built up
+** again. If this happens too often the rest of the
+** match is found by running the NFA directly.
+**
+** A DFA never changes once built in full, so any
+** number of threads can match with it at once. The
+** states of a lazy one are kept in caches which one
+** thread uses at a time. A thread that finds them
+** all in use makes another rather than waiting, so
+** there are as many as threads ever matched with it
+** at once, each within the budget. Copies of a
+** regex parser share their DFA and the last one
+** deleted frees it.
+*/
+
+#define MPC_BITS_HAS(m, k) ((m)[(k) >> 3] & (1 << ((k) & 7)))
+#define MPC_BITS_ADD(m, k) ((m)[(k) >> 3] |= 1 << ((k) & 7))
+
+enum {
+  MPC_NFA_MATCH = 0,
+  MPC_NFA_CLASS = 1,
+  MPC_NFA_SPLIT = 2,
+  MPC_NFA_GUARD = 3
+};
+
+enum {
+  MPC_NFA_NONE = -2,
+  MPC_NFA_END  = -1
+};
+
+typedef struct {
+  int type;
+  int out, out1;
+  unsigned char m[32];
+} mpc_nfa_state_t;
+
+typedef struct {
+  int num, slots;
+  mpc_nfa_state_t *states;
+} mpc_nfa_t;
+
+/* The states built so far and the space to build more in */
+typedef struct mpc_dfa_cache_t {
+  
+  struct mpc_dfa_cache_t *all, *idle;
+  
+  int states, slots;
+  int *trans;
+  unsigned char *accept;
+  unsigned char *eoi;
+  
+  /* Only kept while states are still being built */
+  unsigned char *sets;
+  int *table;
+  unsigned char *cur, *next, *tmp;
+  int *stack;
+  
+  long hits, misses, flushes, fallbacks;
+  long scanned, flushed;
+  
+} mpc_dfa_cache_t;
+
+struct mpc_dfa_t {
+  
+  int refs;
+  mpc_mutex_t lock;
+  
+  int lazy;
+  int classes;
+  unsigned char cls[256];
+  
+  /* Only kept while states are still being built */
+  mpc_nfa_t nfa;
+  int reps[256];
+  int size, max;
+  unsigned char *start;
+  
+  /* Every cache made, and those no thread is using */
+  mpc_dfa_cache_t *caches, *idle;
+  
+  int states;
+  long hits, misses, flushes, fallbacks;
+  
+};
+
+/*
+** Adds all that is reachable without reading to
+** `set`. Guards are passed if `c`, the next char,
+** isn't in their class. At the end of the input it
+** is `MPC_NFA_END` and every guard is passed, and
+** for `MPC_NFA_NONE` none are.
+*/
+static void mpc_nfa_close(const mpc_nfa_t *a, unsigned char *set, int c, int *stack) {
+  
+  int k, top = 0;
+  const mpc_nfa_state_t *x;
+  
+  for (k = 0; k < a->num; k++) {
+    if (MPC_BITS_HAS(set, k)) { stack[top++] = k; }
+  }
+  
+  while (top > 0) {
+    x = &a->states[stack[--top]];
+    if (x->type == MPC_NFA_GUARD && (c == MPC_NFA_NONE || (c >= 0 && MPC_CLASS_HAS(x->m, c)))) { continue; }
+    if (x->type != MPC_NFA_SPLIT && x->type != MPC_NFA_GUARD) { continue; }
+    if (x->out  >= 0 && !MPC_BITS_HAS(set, x->out))  { MPC_BITS_ADD(set, x->out);  stack[top++] = x->out;  }
+    if (x->out1 >= 0 && !MPC_BITS_HAS(set, x->out1)) { MPC_BITS_ADD(set, x->out1); stack[top++] = x->out1; }
+  }
+  
+}
+
+/* Steps `set` over `c` into `next` and returns if it matched just before `c` */
+static int mpc_nfa_step(const mpc_nfa_t *a, const unsigned char *set, int c, unsigned char *next, unsigned char *tmp, int *stack) {
+  
+  int k, size = (a->num + 7) / 8;
+  
+  memcpy(tmp, set, size);
+  mpc_nfa_close(a, tmp, c, stack);
+  
+  memset(next, 0, size);
+  for (k = 0; k < a->num; k++) {
+    if (MPC_BITS_HAS(tmp, k) && a->states[k].type == MPC_NFA_CLASS && MPC_CLASS_HAS(a->states[k].m, c)) {
+      MPC_BITS_ADD(next, a->states[k].out);
+    }
+  }
+  mpc_nfa_close(a, next, MPC_NFA_NONE, stack);
+  
+  return MPC_BITS_HAS(tmp, 0) ? 1 : 0;
+}
+
+static int mpc_nfa_eoi(const mpc_nfa_t *a, const unsigned char *set, unsigned char *tmp, int *stack) {
+  memcpy(tmp, set, (a->num + 7) / 8);
+  mpc_nfa_close(a, tmp, MPC_NFA_END, stack);
+  return MPC_BITS_HAS(tmp, 0) ? 1 : 0;
+}
+
+static int mpc_nfa_empty(const mpc_nfa_t *a, const unsigned char *set) {
+  int k;
+  for (k = 0; k < (a->num + 7) / 8; k++) { if (set[k]) { return 0; } }
+  return 1;
+}
+
+static mpc_dfa_cache_t *mpc_dfa_cache_new(const mpc_dfa_t *d) {
+  mpc_dfa_cache_t *t = calloc(1, sizeof(mpc_dfa_cache_t));
+  t->cur   = malloc(d->size);
+  t->next  = malloc(d->size);
+  t->tmp   = malloc(d->size);
+  t->stack = malloc(sizeof(int) * d->nfa.num);
+  return t;
+}
+
+/* Frees what is only needed to build more states */
+static void mpc_dfa_cache_done(mpc_dfa_cache_t *t) {
+  free(t->sets);  t->sets = NULL;
+  free(t->table); t->table = NULL;
+  free(t->cur);   t->cur = NULL;
+  free(t->next);  t->next = NULL;
+  free(t->tmp);   t->tmp = NULL;
+  free(t->stack); t->stack = NULL;
+}
+
+static void mpc_dfa_free(mpc_dfa_t *d) {
+  mpc_dfa_cache_t *t;
+  MPC_MUTEX_FREE(d->lock);
+  while (d->caches) {
+    t = d->caches;
+    d->caches = t->all;
+    mpc_dfa_cache_done(t);
+    free(t->trans);
+    free(t->accept);
+    free(t->eoi);
+    free(t);
+  }
+  free(d->nfa.states);
+  free(d->start);
+  free(d);
+}
+
+static mpc_dfa_t *mpc_dfa_retain(mpc_dfa_t *d) {
+  MPC_LOCK(d->lock);
+  d->refs++;
+  MPC_UNLOCK(d->lock);
+  return d;
+}
+
+static void mpc_dfa_release(mpc_dfa_t *d) {
+  int refs;
+  MPC_LOCK(d->lock);
+  refs = --d->refs;
+  MPC_UNLOCK(d->lock);
+  if (refs == 0) { mpc_dfa_free(d); }
+}
+
+static unsigned long mpc_dfa_hash(const mpc_dfa_t *d, const unsigned char *set) {
+  int k;
+  unsigned long h = 2166136261ul;
+  for (k = 0; k < d->size; k++) { h = (h ^ set[k]) * 16777619ul; }
+  return h;
+}
+
+static int mpc_dfa_find(const mpc_dfa_t *d, const mpc_dfa_cache_t *t, const unsigned char *set) {
+  unsigned long k = mpc_dfa_hash(d, set) % (t->slots * 2);
+  while (t->table[k] >= 0) {
+    if (memcmp(t->sets + t->table[k] * d->size, set, d->size) == 0) { return t->table[k]; }
+    k = (k + 1) % (t->slots * 2);
+  }
+  return -1;
+}
+
+static void mpc_dfa_insert(const mpc_dfa_t *d, mpc_dfa_cache_t *t, int q) {
+  unsigned long k = mpc_dfa_hash(d, t->sets + q * d->size) % (t->slots * 2);
+  while (t->table[k] >= 0) { k = (k + 1) % (t->slots * 2); }
+  t->table[k] = q;
+}
+
+/* Adds a state for `set`, which must not be there already, or returns -1 when over budget */
+static int mpc_dfa_add(const mpc_dfa_t *d, mpc_dfa_cache_t *t, const unsigned char *set) {
+  
+  int k, q = t->states, w = d->classes;
+  
+  if (q == d->max) { return -1; }
+  
+  if (q == t->slots) {
+    t->slots = t->slots ? t->slots * 2 : 8;
+    t->slots = t->slots < d->max ? t->slots : d->max;
+    t->trans  = realloc(t->trans,  sizeof(int) * t->slots * w);
+    t->accept = realloc(t->accept, t->slots * w);
+    t->eoi    = realloc(t->eoi,    t->slots);
+    t->sets   = realloc(t->sets,   t->slots * d->size);
+    t->table  = realloc(t->table,  sizeof(int) * t->slots * 2);
+    for (k = 0; k < t->slots * 2; k++) { t->table[k] = -1; }
+    for (k = 0; k < q; k++) { mpc_dfa_insert(d, t, k); }
+  }
+  
+  memcpy(t->sets + q * d->size, set, d->size);
+  for (k = 0; k < w; k++) { t->trans[q * w + k] = -1; }
+  memset(t->accept + q * w, 0, w);
+  t->eoi[q] = mpc_nfa_eoi(&d->nfa, set, t->tmp, t->stack);
+  mpc_dfa_insert(d, t, q);
+  
+  t->states++;
+  return q;
+}
+
+/* Throws away every state but the dead and starting ones */
+static void mpc_dfa_flush(const mpc_dfa_t *d, mpc_dfa_cache_t *t) {
+  int k;
+  t->states = 0;
+  for (k = 0; k < t->slots * 2; k++) { t->table[k] = -1; }
+  memset(t->next, 0, d->size);
+  mpc_dfa_add(d, t, t->next);
+  mpc_dfa_add(d, t, d->start);
+}
+
+/* Builds the transition from `q` over class `c`, or returns -1 when over budget */
+static int mpc_dfa_expand(const mpc_dfa_t *d, mpc_dfa_cache_t *t, int q, int c) {
+  
+  int j, acc;
+  
+  acc = mpc_nfa_step(&d->nfa, t->sets + q * d->size, d->reps[c], t->next, t->tmp, t->stack);
+  
+  j = mpc_dfa_find(d, t, t->next);
+  if (j < 0) { j = mpc_dfa_add(d, t, t->next); }
+  if (j < 0) { return -1; }
+  
+  t->trans[q * d->classes + c] = j;
+  t->accept[q * d->classes + c] = acc;
+  return j;
+}
+
+/* Runs the NFA from the set in `cur` at `k` */
+static int mpc_dfa_simulate(const mpc_dfa_t *d, mpc_dfa_cache_t *t, const char *s, int k, int n, int end, int *stop) {
+  
+  unsigned char *cur = t->cur, *next = t->next, *x;
+  
+  t->fallbacks++;
+  
+  while (k < n) {
+    if (mpc_nfa_step(&d->nfa, cur, (unsigned char)s[k], next, t->tmp, t->stack)) { end = k; }
+    x = cur; cur = next; next = x;
+    if (mpc_nfa_empty(&d->nfa, cur)) { break; }
+    k++;
+  }
+  
+  if (k == n && mpc_nfa_eoi(&d->nfa, cur, t->tmp, t->stack)) { end = n; }
+  
+  *stop = k;
+  return end;
+}
+
+/*
+** On a flush the cache is said to be thrashing if
+** less than ten bytes were matched for each state
+** it can hold since the flush before.
+*/
+static int mpc_dfa_run_lazy(const mpc_dfa_t *d, mpc_dfa_cache_t *t, const char *s, int n, int *stop) {
+  
+  int k = 0, q = 1, j, c, w = d->classes, end = -1;
+  long seen;
+  
+  while (k < n) {
+    
+    c = d->cls[(unsigned char)s[k]];
+    j = t->trans[q * w + c];
+    
+    if (j >= 0) {
+      t->hits++;
+    } else {
+      t->misses++;
+      j = mpc_dfa_expand(d, t, q, c);
+    }
+    
+    if (j < 0) {
+      
+      memcpy(t->cur, t->sets + q * d->size, d->size);
+      mpc_dfa_flush(d, t);
+      
+      seen = t->scanned + k - t->flushed;
+      t->flushed = t->scanned + k;
+      t->flushes++;
+      
+      if (seen < 10L * d->max) {
+        end = mpc_dfa_simulate(d, t, s, k, n, end, stop);
+        t->scanned += *stop;
+        return end;
+      }
+      
+      q = mpc_dfa_find(d, t, t->cur);
+      if (q < 0) { q = mpc_dfa_add(d, t, t->cur); }
+      j = mpc_dfa_expand(d, t, q, c);
+    }
+    
+    if (t->accept[q * w + c]) { end = k; }
+    q = j;
+    if (q == 0) { break; }
+    k++;
+  }
+  
+  if (k == n && t->eoi[q]) { end = n; }
+  
+  t->scanned += k;
+  *stop = k;
+  return end;
+}
+
+static int mpc_dfa_run(const mpc_dfa_t *d, const char *s, int n, int *stop) {
+  
+  const unsigned char *cls = d->cls, *a = d->caches->accept;
+  const int *t = d->caches->trans;
+  int k = 0, q = 1, c, w = d->classes, end = -1;
+  
+  while (k < n) {
+    c = q * w + cls[(unsigned char)s[k]];
+    if (a[c]) { end = k; }
+    q = t[c];
+    if (q == 0) { break; }
+    k++;
+  }
+  
+  if (k == n && d->caches->eoi[q]) { end = n; }
+  
+  *stop = k;
+  return end;
+}
+
+/* Takes a lazy cache no other thread is using, making a new one if there is none */
+static mpc_dfa_cache_t *mpc_dfa_take(mpc_dfa_t *d) {
+  
+  mpc_dfa_cache_t *t;
+  
+  MPC_LOCK(d->lock);
+  t = d->idle;
+  if (t) { d->idle = t->idle; }
+  MPC_UNLOCK(d->lock);
+  
+  if (t) { return t; }
+  
+  t = mpc_dfa_cache_new(d);
+  mpc_dfa_flush(d, t);
+  
+  MPC_LOCK(d->lock);
+  t->all = d->caches;
+  d->caches = t;
+  MPC_UNLOCK(d->lock);
+  
+  return t;
+}
+
+/* Puts a cache back, adding what it counted to the totals */
+static void mpc_dfa_give(mpc_dfa_t *d, mpc_dfa_cache_t *t) {
+  MPC_LOCK(d->lock);
+  d->states = t->states;
+  d->hits += t->hits;           t->hits = 0;
+  d->misses += t->misses;       t->misses = 0;
+  d->flushes += t->flushes;     t->flushes = 0;
+  d->fallbacks += t->fallbacks; t->fallbacks = 0;
+  t->idle = d->idle;
+  d->idle = t;
+  MPC_UNLOCK(d->lock);
+}
+
+/*
+** Returns the length of the longest match, or -1 if
+** there is none. Classes never match the zero byte so
+** that a stray one can be left to the slow path, and
+** -2 is returned if the run stopped on one.
+*/
+static int mpc_input_dfa_run(mpc_input_t *i, mpc_dfa_t *d, int *stop) {
+  
+  const char *s = i->string + i->state.pos;
+  int n = i->length - i->state.pos;
+  int end, k;
+  mpc_dfa_cache_t *t;
+  
+  if (d->lazy) {
+    t = mpc_dfa_take(d);
+    end = mpc_dfa_run_lazy(d, t, s, n, &k);
+    mpc_dfa_give(d, t);
+  } else {
+    end = mpc_dfa_run(d, s, n, &k);
+  }
+  
+  if (k < n && s[k] == '\0') { return -2; }
+  if (end > 0) { mpc_input_advance(i, s, end); }
+  *stop = i->state.pos + k;
+  return end;
+}
+
 /*
 ** This is rather pleasant. The core parsing routine
 ** is written in about 200 lines of C.
@@ -953,24 +2935,78 @@ static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
 ** But it is now a pretty ugly beast...
 */
 
-#define MPC_CONTINUE(st, x) mpc_stack_set_state(stk, st); mpc_stack_pushp(stk, x); continue
-#define MPC_SUCCESS(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_out(x), 1); continue
-#define MPC_FAILURE(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_err(x), 0); continue
-#define MPC_PRIMATIVE(x, f) if (f) { MPC_SUCCESS(x); } else { MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Incorrect Input")); }
+/*
+** Where the compiler allows taking the address
+** of a label the machine uses threaded dispatch.
+** Rather than every step going back around the
+** loop through the one `switch`, each handler
+** ends with its own jump through a table of
+** labels, which branch predictors cope with far
+** better. This is a GNU extension, but it is
+** marked as one so `-std=c99 -pedantic` builds
+** still get it. Other compilers, or builds with
+** `MPC_NO_THREADED`, just use the `switch`.
+*/
 
-int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+#if defined(__GNUC__) && !defined(MPC_NO_THREADED)
+#define MPC_THREADED
+#endif
+
+#ifdef MPC_THREADED
+#define MPC_CASE(t) case t: mpc_op_##t
+#define MPC_LABEL(t) __extension__ &&mpc_op_##t
+#define MPC_NEXT() if (mpc_stack_empty(stk)) { return 1; } mpc_stack_peepp(stk, &p, &st); __extension__ ({ goto *mpc_dispatch[(int)p->type]; })
+#else
+#define MPC_CASE(t) case t
+#define MPC_NEXT() continue
+#endif
+
+#define MPC_CONTINUE(st, x) mpc_stack_set_state(stk, st); mpc_stack_pushp(stk, x); MPC_NEXT()
+#define MPC_SUCCESS(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_out(x), 1); MPC_PROFILE_LEAVE(stk, p); MPC_EVENTS_LEAVE(stk, p); MPC_NEXT()
+#define MPC_FAILURE(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_err(stk->quiet ? NULL : (x)), 0); MPC_PROFILE_LEAVE(stk, p); MPC_EVENTS_LEAVE(stk, p); MPC_NEXT()
+#define MPC_FORWARD() mpc_stack_popp(stk, &p, &st); MPC_PROFILE_LEAVE(stk, p); MPC_EVENTS_LEAVE(stk, p); MPC_NEXT()
+#define MPC_LIFT(lf) mpc_stack_popp(stk, &p, &st); mpc_stack_lift(stk, lf); MPC_PROFILE_LEAVE(stk, p); MPC_EVENTS_LEAVE(stk, p); MPC_NEXT()
+#define MPC_MERGE(n, f) mpc_stack_popp(stk, &p, &st); mpc_stack_merger_out(stk, n, f, p->mark & MPC_MARK_TREE); MPC_PROFILE_LEAVE(stk, p); MPC_EVENTS_LEAVE(stk, p); MPC_NEXT()
+#define MPC_MATCHED(x, pos) mpc_stack_popp(stk, &p, &st); if (o) { mpc_stack_pushr(stk, mpc_result_out(x), 1); } else { mpc_stack_pushs(stk, pos, i->state.pos - pos); } MPC_PROFILE_LEAVE(stk, p); MPC_EVENTS_LEAVE(stk, p); MPC_NEXT()
+#define MPC_PRIMATIVE(x, f) pos = i->state.pos; if (f) { MPC_MATCHED(x, pos); } else if (i->starved) { return 0; } else { if (stk->quiet) { mpc_stack_far(stk, NULL, "Incorrect Input"); } MPC_FAILURE(mpc_err_fail(i->filename, mpc_input_state(i), "Incorrect Input")); }
+
+/*
+** Runs the machine until the stack is empty and
+** returns one. If a partial input runs dry it
+** returns zero instead, leaving the stack just
+** as it was so the same primitive is retried
+** once more input has arrived.
+*/
+
+static int mpc_parse_run(mpc_input_t *i, mpc_stack_t *stk) {
   
   /* Stack */
   int st = 0;
   mpc_parser_t *p = NULL;
-  mpc_stack_t *stk = mpc_stack_new(i->filename);
   
   /* Variables */
   char *s;
+  int pos, n, k;
+  mpc_parser_t *c;
   mpc_result_t r;
-
-  /* Go! */
-  mpc_stack_pushp(stk, init);
+  mpc_memo_t *m;
+  
+#ifdef MPC_THREADED
+  /* Indexed by parser type so must follow the order of the enum */
+  static void *mpc_dispatch[] = {
+    MPC_LABEL(MPC_TYPE_UNDEFINED), MPC_LABEL(MPC_TYPE_PASS), MPC_LABEL(MPC_TYPE_FAIL), MPC_LABEL(MPC_TYPE_LIFT),
+    MPC_LABEL(MPC_TYPE_LIFT_VAL), MPC_LABEL(MPC_TYPE_EXPECT), MPC_LABEL(MPC_TYPE_ANCHOR), MPC_LABEL(MPC_TYPE_STATE),
+    MPC_LABEL(MPC_TYPE_ANY), MPC_LABEL(MPC_TYPE_SINGLE), MPC_LABEL(MPC_TYPE_ONEOF), MPC_LABEL(MPC_TYPE_NONEOF),
+    MPC_LABEL(MPC_TYPE_RANGE), MPC_LABEL(MPC_TYPE_SATISFY), MPC_LABEL(MPC_TYPE_STRING), MPC_LABEL(MPC_TYPE_APPLY),
+    MPC_LABEL(MPC_TYPE_APPLY_TO), MPC_LABEL(MPC_TYPE_PREDICT), MPC_LABEL(MPC_TYPE_NOT), MPC_LABEL(MPC_TYPE_MAYBE),
+    MPC_LABEL(MPC_TYPE_MANY), MPC_LABEL(MPC_TYPE_MANY1), MPC_LABEL(MPC_TYPE_COUNT), MPC_LABEL(MPC_TYPE_OR),
+    MPC_LABEL(MPC_TYPE_AND), MPC_LABEL(MPC_TYPE_MEMO), MPC_LABEL(MPC_TYPE_CODE),
+    MPC_LABEL(MPC_TYPE_CUT), MPC_LABEL(MPC_TYPE_DFA)
+  };
+#endif
+  
+  /* Primitives only copy out text when spans are unavailable */
+  char **o = stk->spanned ? NULL : &s;
   
   while (!mpc_stack_empty(stk)) {
     
@@ -980,46 +3016,65 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
       
       /* Basic Parsers */
 
-      case MPC_TYPE_ANY:       MPC_PRIMATIVE(s, mpc_input_any(i, &s));
-      case MPC_TYPE_SINGLE:    MPC_PRIMATIVE(s, mpc_input_char(i, p->data.single.x, &s));
-      case MPC_TYPE_RANGE:     MPC_PRIMATIVE(s, mpc_input_range(i, p->data.range.x, p->data.range.y, &s));
-      case MPC_TYPE_ONEOF:     MPC_PRIMATIVE(s, mpc_input_oneof(i, p->data.string.x, &s));
-      case MPC_TYPE_NONEOF:    MPC_PRIMATIVE(s, mpc_input_noneof(i, p->data.string.x, &s));
-      case MPC_TYPE_SATISFY:   MPC_PRIMATIVE(s, mpc_input_satisfy(i, p->data.satisfy.f, &s));
-      case MPC_TYPE_STRING:    MPC_PRIMATIVE(s, mpc_input_string(i, p->data.string.x, &s));
+      MPC_CASE(MPC_TYPE_ANY):       MPC_PRIMATIVE(s, mpc_input_any(i, o));
+      MPC_CASE(MPC_TYPE_SINGLE):    MPC_PRIMATIVE(s, mpc_input_char(i, p->data.single.x, o));
+      MPC_CASE(MPC_TYPE_RANGE):     MPC_PRIMATIVE(s, mpc_input_range(i, p->data.range.x, p->data.range.y, o));
+      MPC_CASE(MPC_TYPE_ONEOF):     MPC_PRIMATIVE(s, mpc_input_oneof(i, p->data.string.m, o));
+      MPC_CASE(MPC_TYPE_NONEOF):    MPC_PRIMATIVE(s, mpc_input_noneof(i, p->data.string.m, o));
+      MPC_CASE(MPC_TYPE_SATISFY):   MPC_PRIMATIVE(s, mpc_input_satisfy(i, p->data.satisfy.f, o));
+      MPC_CASE(MPC_TYPE_STRING):    MPC_PRIMATIVE(s, mpc_input_string(i, p->data.string.x, p->data.string.n, o));
       
       /* Other parsers */
       
-      case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Parser Undefined!"));      
-      case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-      case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i->filename, i->state, p->data.fail.m));
-      case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
-      case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
-      case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_state_copy(i->state));
+      MPC_CASE(MPC_TYPE_UNDEFINED):
+        if (stk->quiet) { mpc_stack_far(stk, NULL, "Parser Undefined!"); }
+        MPC_FAILURE(mpc_err_fail(i->filename, mpc_input_state(i), "Parser Undefined!"));      
+      MPC_CASE(MPC_TYPE_PASS):      MPC_SUCCESS(NULL);
+      MPC_CASE(MPC_TYPE_FAIL):
+        if (stk->quiet) { mpc_stack_far(stk, NULL, p->data.fail.m); }
+        MPC_FAILURE(mpc_err_fail(i->filename, mpc_input_state(i), p->data.fail.m));
+      MPC_CASE(MPC_TYPE_LIFT):      MPC_LIFT(p->data.lift.lf);
+      MPC_CASE(MPC_TYPE_LIFT_VAL):  MPC_SUCCESS(p->data.lift.x);
+      MPC_CASE(MPC_TYPE_STATE):     MPC_SUCCESS(mpc_state_copy(mpc_input_state(i)));
       
-      case MPC_TYPE_ANCHOR:
+      MPC_CASE(MPC_TYPE_ANCHOR):
+        if (i->partial && i->state.pos >= i->length) { return 0; }
         if (mpc_input_anchor(i, p->data.anchor.f)) {
           MPC_SUCCESS(NULL);
         } else {
-          MPC_FAILURE(mpc_err_new(i->filename, i->state, "anchor", mpc_input_peekc(i)));
+          if (stk->quiet) { mpc_stack_far(stk, "anchor", NULL); }
+          MPC_FAILURE(mpc_err_new(i->filename, mpc_input_state(i), "anchor", mpc_input_peekc(i)));
         }
       
       /* Application Parsers */
       
-      case MPC_TYPE_EXPECT:
-        if (st == 0) { MPC_CONTINUE(1, p->data.expect.x); }
+      MPC_CASE(MPC_TYPE_EXPECT):
+        if (st == 0) { stk->far_depth++; MPC_CONTINUE(1, p->data.expect.x); }
         if (st == 1) {
-          if (mpc_stack_popr(stk, &r)) {
-            MPC_SUCCESS(r.output);
+          stk->far_depth--;
+          if (mpc_stack_peekr(stk, &r)) {
+            MPC_FORWARD();
           } else {
-            mpc_err_delete(r.error); 
-            MPC_FAILURE(mpc_err_new(i->filename, i->state, p->data.expect.m, mpc_input_peekc(i)));
+            mpc_stack_popr(stk, &r);
+            if (r.error) { mpc_err_delete(r.error); }
+            if (stk->quiet) { mpc_stack_far(stk, p->data.expect.m, NULL); }
+            MPC_FAILURE(mpc_err_new(i->filename, mpc_input_state(i), p->data.expect.m, mpc_input_peekc(i)));
           }
         }
       
-      case MPC_TYPE_APPLY:
+      MPC_CASE(MPC_TYPE_APPLY):
+        if (st == 0 && stk->events && (p->mark & MPC_MARK_TOKEN)) { MPC_CONTINUE(2 + i->state.pos, p->data.apply.x); }
         if (st == 0) { MPC_CONTINUE(1, p->data.apply.x); }
+        if (st > 1) {
+          if (!mpc_stack_peekr(stk, &r)) { MPC_FORWARD(); }
+          mpc_stack_events_token(stk, st - 2);
+          MPC_SUCCESS(NULL);
+        }
         if (st == 1) {
+          if (p->data.apply.f == mpcf_free && mpc_stack_peekr(stk, &r) == MPC_RESULT_SPAN) {
+            mpc_stack_dropr(stk, &r);
+            MPC_SUCCESS(NULL);
+          }
           if (mpc_stack_popr(stk, &r)) {
             MPC_SUCCESS(p->data.apply.f(r.output));
           } else {
@@ -1027,7 +3082,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           }
         }
       
-      case MPC_TYPE_APPLY_TO:
+      MPC_CASE(MPC_TYPE_APPLY_TO):
         if (st == 0) { MPC_CONTINUE(1, p->data.apply_to.x); }
         if (st == 1) {
           if (mpc_stack_popr(stk, &r)) {
@@ -1037,61 +3092,120 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           }
         }
       
-      case MPC_TYPE_PREDICT:
+      MPC_CASE(MPC_TYPE_PREDICT):
         if (st == 0) { mpc_input_backtrack_disable(i); MPC_CONTINUE(1, p->data.predict.x); }
         if (st == 1) {
           mpc_input_backtrack_enable(i);
+          MPC_FORWARD();
+        }
+      
+      /* Memo is only consulted where the input can be jumped about freely */
+      
+      MPC_CASE(MPC_TYPE_MEMO):
+        if (st == 0) {
+          if (!stk->spanned || i->backtrack < 1 || stk->events) { MPC_CONTINUE(1, p->data.memo.x); }
+          m = mpc_stack_memo_find(stk, p, i->state.pos);
+          if (m == NULL) { MPC_CONTINUE(2 + i->state.pos, p->data.memo.x); }
           mpc_stack_popp(stk, &p, &st);
-          continue;
+          mpc_stack_memo_replay(stk, m);
+          MPC_PROFILE_LEAVE(stk, p);
+          MPC_NEXT();
         }
+        if (st == 1) { MPC_FORWARD(); }
+        if (!stk->committed) { mpc_stack_memo_store(stk, p, st - 2); }
+        MPC_FORWARD();
+      
+      MPC_CASE(MPC_TYPE_CODE):
+        if (st == 0) { MPC_CONTINUE(1, p->data.code.code); }
+        if (st == 1) { MPC_FORWARD(); }
+      
+      MPC_CASE(MPC_TYPE_CUT):
+        mpc_stack_cut(stk, i);
+        MPC_SUCCESS(NULL);
+      
+      /* Errors, partial input and disabled backtracking are left to the combinators */
+      
+      MPC_CASE(MPC_TYPE_DFA):
+        if (st == 0 && stk->quiet && stk->spanned && !i->partial && i->backtrack > 0) {
+          pos = i->state.pos;
+          n = mpc_input_dfa_run(i, p->data.dfa.d, &k);
+          if (n == -1) { mpc_stack_far_dfa(stk, p->data.dfa.x, k); MPC_FAILURE(NULL); }
+          if (n >=  0) { MPC_MATCHED(NULL, pos); }
+        }
+        if (st == 0) { MPC_CONTINUE(1, p->data.dfa.x); }
+        MPC_FORWARD();
       
       /* Optional Parsers */
       
       /* TODO: Update Not Error Message */
       
-      case MPC_TYPE_NOT:
-        if (st == 0) { mpc_input_mark(i); MPC_CONTINUE(1, p->data.not.x); }
+      MPC_CASE(MPC_TYPE_NOT):
+        if (st == 0) { mpc_stack_mark(stk, i); MPC_CONTINUE(1, p->data.not.x); }
         if (st == 1) {
-          if (mpc_stack_popr(stk, &r)) {
-            mpc_input_rewind(i);
-            p->data.not.dx(r.output);
-            MPC_FAILURE(mpc_err_new(i->filename, i->state, "opposite", mpc_input_peekc(i)));
+          if (mpc_stack_peekr(stk, &r)) {
+            MPC_PROFILE_REWIND(p, i);
+            mpc_stack_rewind(stk, i);
+            mpc_stack_popr_out_single(stk, 1, p->data.not.dx);
+            if (stk->quiet) { mpc_stack_far(stk, "opposite", NULL); }
+            MPC_FAILURE(mpc_err_new(i->filename, mpc_input_state(i), "opposite", mpc_input_peekc(i)));
+          } else if (stk->committed) {
+            mpc_stack_unmark(stk, i);
+            MPC_FORWARD();
           } else {
-            mpc_input_unmark(i);
+            mpc_stack_popr(stk, &r);
+            mpc_stack_unmark(stk, i);
             mpc_stack_err(stk, r.error);
-            MPC_SUCCESS(p->data.not.lf());
+            MPC_LIFT(p->data.not.lf);
           }
         }
       
-      case MPC_TYPE_MAYBE:
+      MPC_CASE(MPC_TYPE_MAYBE):
         if (st == 0) { MPC_CONTINUE(1, p->data.not.x); }
         if (st == 1) {
-          if (mpc_stack_popr(stk, &r)) {
-            MPC_SUCCESS(r.output);
+          if (mpc_stack_peekr(stk, &r) || stk->committed) {
+            MPC_FORWARD();
           } else {
+            mpc_stack_popr(stk, &r);
             mpc_stack_err(stk, r.error);
-            MPC_SUCCESS(p->data.not.lf());
+            MPC_LIFT(p->data.not.lf);
           }
         }
       
       /* Repeat Parsers */
       
-      case MPC_TYPE_MANY:
+      MPC_CASE(MPC_TYPE_MANY):
+        if (st == 0 && stk->spanned && p->data.repeat.f == mpcf_strfold && (c = mpc_class_of(p->data.repeat.x))) {
+          pos = i->state.pos;
+          if ((n = mpc_input_class_run(i, c)) < 0) { return 0; }
+          if (!stk->quiet) { mpc_stack_err(stk, mpc_class_err(i, p->data.repeat.x)); }
+          else { mpc_stack_far_class(stk, p->data.repeat.x); }
+          MPC_MATCHED(NULL, pos);
+        }
         if (st == 0) { MPC_CONTINUE(st+1, p->data.repeat.x); }
         if (st >  0) {
           if (mpc_stack_peekr(stk, &r)) {
+            if (stk->committed) { MPC_MERGE(st, p->data.repeat.f); }
             MPC_CONTINUE(st+1, p->data.repeat.x);
           } else {
             mpc_stack_popr(stk, &r);
             mpc_stack_err(stk, r.error);
-            MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
+            MPC_MERGE(st-1, p->data.repeat.f);
           }
         }
       
-      case MPC_TYPE_MANY1:
+      MPC_CASE(MPC_TYPE_MANY1):
+        if (st == 0 && stk->spanned && p->data.repeat.f == mpcf_strfold && (c = mpc_class_of(p->data.repeat.x))) {
+          pos = i->state.pos;
+          if ((n = mpc_input_class_run(i, c)) < 0) { return 0; }
+          if (stk->quiet) { mpc_stack_far_class(stk, p->data.repeat.x); }
+          if (n == 0) { MPC_FAILURE(mpc_err_many1(mpc_class_err(i, p->data.repeat.x))); }
+          if (!stk->quiet) { mpc_stack_err(stk, mpc_class_err(i, p->data.repeat.x)); }
+          MPC_MATCHED(NULL, pos);
+        }
         if (st == 0) { MPC_CONTINUE(st+1, p->data.repeat.x); }
         if (st >  0) {
           if (mpc_stack_peekr(stk, &r)) {
+            if (stk->committed) { MPC_MERGE(st, p->data.repeat.f); }
             MPC_CONTINUE(st+1, p->data.repeat.x);
           } else {
             if (st == 1) {
@@ -1100,119 +3214,703 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
             } else {
               mpc_stack_popr(stk, &r);
               mpc_stack_err(stk, r.error);
-              MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
+              MPC_MERGE(st-1, p->data.repeat.f);
             }
           }
         }
       
-      case MPC_TYPE_COUNT:
-        if (st == 0) { mpc_input_mark(i); MPC_CONTINUE(st+1, p->data.repeat.x); }
+      MPC_CASE(MPC_TYPE_COUNT):
+        if (st == 0) { mpc_stack_mark(stk, i); MPC_CONTINUE(st+1, p->data.repeat.x); }
         if (st >  0) {
           if (mpc_stack_peekr(stk, &r)) {
+            if (stk->committed) {
+              mpc_stack_popr_out_single(stk, st, p->data.repeat.dx);
+              mpc_stack_unmark(stk, i);
+              MPC_FAILURE(mpc_stack_committed_err(stk));
+            }
             MPC_CONTINUE(st+1, p->data.repeat.x);
           } else {
             if (st != (p->data.repeat.n+1)) {
               mpc_stack_popr(stk, &r);
               mpc_stack_popr_out_single(stk, st-1, p->data.repeat.dx);
-              mpc_input_rewind(i);
+              MPC_PROFILE_REWIND(p, i);
+              mpc_stack_rewind(stk, i);
               MPC_FAILURE(mpc_err_count(r.error, p->data.repeat.n));
             } else {
               mpc_stack_popr(stk, &r);
               mpc_stack_err(stk, r.error);
-              mpc_input_unmark(i);
-              MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
+              mpc_stack_unmark(stk, i);
+              MPC_MERGE(st-1, p->data.repeat.f);
             }
           }
         }
         
       /* Combinatory Parsers */
       
-      case MPC_TYPE_OR:
+      MPC_CASE(MPC_TYPE_OR):
         
         if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
         
-        if (st == 0) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
-        if (st <= p->data.or.n) {
-          if (mpc_stack_peekr(stk, &r)) {
-            mpc_stack_popr(stk, &r);
-            mpc_stack_popr_err(stk, st-1);
-            MPC_SUCCESS(r.output);
-          }
-          if (st <  p->data.or.n) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
-          if (st == p->data.or.n) { MPC_FAILURE(mpc_stack_merger_err(stk, p->data.or.n)); }
+        if (st > 0 && (mpc_stack_peekr(stk, &r) || stk->committed)) {
+          mpc_stack_popr_err_under(stk, st-1);
+          MPC_FORWARD();
         }
+        
+        st += mpc_stack_or_skip(stk, p, st);
+        if (st <  p->data.or.n) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
+        if (st == p->data.or.n) { r.error = mpc_stack_merger_err(stk, p->data.or.n); MPC_FAILURE(r.error); }
       
-      case MPC_TYPE_AND:
+      MPC_CASE(MPC_TYPE_AND):
         
         if (p->data.or.n == 0) { MPC_SUCCESS(p->data.and.f(0, NULL)); }
         
-        if (st == 0) { mpc_input_mark(i); MPC_CONTINUE(st+1, p->data.and.xs[st]); }
+        if (st == 0) { mpc_stack_mark(stk, i); MPC_CONTINUE(st+1, p->data.and.xs[st]); }
         if (st <= p->data.and.n) {
           if (!mpc_stack_peekr(stk, &r)) {
-            mpc_input_rewind(i);
+            MPC_PROFILE_REWIND(p, i);
+            mpc_stack_rewind(stk, i);
             mpc_stack_popr(stk, &r);
             mpc_stack_popr_out(stk, st-1, p->data.and.dxs);
             MPC_FAILURE(r.error);
           }
+          if (stk->committed && st < p->data.and.n) {
+            mpc_stack_unmark(stk, i);
+            mpc_stack_popr_out(stk, st, p->data.and.dxs);
+            MPC_FAILURE(mpc_stack_committed_err(stk));
+          }
           if (st <  p->data.and.n) { MPC_CONTINUE(st+1, p->data.and.xs[st]); }
-          if (st == p->data.and.n) { mpc_input_unmark(i); MPC_SUCCESS(mpc_stack_merger_out(stk, p->data.and.n, p->data.and.f)); }
+          if (st == p->data.and.n) { mpc_stack_unmark(stk, i); MPC_MERGE(p->data.and.n, p->data.and.f); }
         }
       
       /* End */
       
       default:
         
-        MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Unknown Parser Type Id!"));
+        MPC_FAILURE(mpc_err_fail(i->filename, mpc_input_state(i), "Unknown Parser Type Id!"));
+    }
+  }
+  
+  return 1;
+  
+}
+
+#undef MPC_CASE
+#undef MPC_NEXT
+#undef MPC_CONTINUE
+#undef MPC_SUCCESS
+#undef MPC_FAILURE
+#undef MPC_FORWARD
+#undef MPC_LIFT
+#undef MPC_MERGE
+#undef MPC_MATCHED
+#undef MPC_PRIMATIVE
+
+/*
+** Asks the regexes whose automata failed farthest
+** what they expected there, by running their own
+** combinators quietly from where each started.
+** These hold no user functions, so nothing is seen
+** to run twice.
+*/
+
+static void mpc_stack_far_resolve(mpc_stack_t *stk, mpc_input_t *i) {
+  
+  int j, k;
+  mpc_stack_t sub;
+  mpc_result_t r;
+  mpc_state_t state = i->state;
+  char last = i->last;
+  
+  for (j = 0; j < stk->far_dfa_num; j++) {
+    
+    i->state = mpc_input_state_at(i, stk->far_dfa_at[j]);
+    i->last = i->state.pos > 0 ? i->string[i->state.pos-1] : '\0';
+    
+    mpc_stack_init(&sub);
+    mpc_stack_begin(&sub, i, 1);
+    mpc_stack_pushp(&sub, stk->far_dfa[j]);
+    mpc_parse_run(i, &sub);
+    
+    if (sub.far_pos == stk->far_pos) {
+      if (sub.far_failure) { mpc_stack_far_add(stk, NULL, sub.far_failure); }
+      for (k = 0; k < sub.far_num; k++) { mpc_stack_far_add(stk, sub.far_expected[k], NULL); }
+    }
+    
+    if (mpc_stack_terminate(&sub, &r)) { free(r.output); } else { mpc_err_delete(r.error); }
+    mpc_stack_trim(&sub);
+  }
+  
+  if (stk->far_num == 0 && stk->far_failure == NULL) { stk->far_failure = "Incorrect Input"; }
+  
+  stk->far_dfa_num = 0;
+  i->state = state;
+  i->last = last;
+}
+
+/*
+** A parse is run once, loudly unless `quiet` is set.
+** Quiet parsing is only asked for explicitly, with
+** `mpc_parse_quiet`, as its messages are built from
+** less and may name fewer of the alternatives.
+*/
+
+static int mpc_stack_parse(mpc_stack_t *stk, mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final, int quiet) {
+  
+  mpc_result_t r;
+  
+  mpc_stack_begin(stk, i, quiet);
+  mpc_stack_pushp(stk, init);
+  mpc_parse_run(i, stk);
+  
+  if (stk->quiet && stk->far_dfa_num > 0 && !mpc_stack_peekr(stk, &r)) {
+    mpc_stack_far_resolve(stk, i);
+  }
+  
+  return mpc_stack_terminate(stk, final);
+}
+
+/*
+** Threads
+**
+** Everything a parse changes lives in its own
+** stack and input, and the parser graph is only
+** ever read. So once a grammar is finished (say
+** `mpca_lang` has returned) any number of threads
+** may parse with it at once, with no locking.
+**
+** What must not overlap a parse is anything that
+** changes the graph: `mpc_define`, `mpc_undefine`,
+** `mpc_optimise`, `mpc_delete` and the like. A
+** profiling build also breaks this, as it keeps
+** its counters in the parsers.
+*/
+
+int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+  int x;
+  mpc_stack_t stk;
+  mpc_stack_init(&stk);
+  x = mpc_stack_parse(&stk, i, init, final, 0);
+  mpc_stack_trim(&stk);
+  return x;
+}
+
+int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  return mpc_parse_n(filename, string, strlen(string), p, r);
+}
+
+int mpc_parse_n(const char *filename, const char *string, int length, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(filename, string, length);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+/*
+** A quiet parse builds no error messages along the
+** way, only noting the farthest point anything
+** failed at and what was expected there. Failing
+** parses are much cheaper, but the final message
+** may name fewer of the alternatives.
+*/
+
+int mpc_parse_quiet(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_stack_t stk;
+  mpc_input_t *i = mpc_input_new_string(filename, string, strlen(string));
+  mpc_stack_init(&stk);
+  x = mpc_stack_parse(&stk, i, p, r, 1);
+  mpc_stack_trim(&stk);
+  mpc_input_delete(i);
+  return x;
+}
+
+/*
+** The output or error of an arena parse belongs
+** to the arena. It stays valid until the arena is
+** cleared or deleted, and must not be passed to
+** `mpc_ast_delete` or `mpc_err_delete` after the
+** parse is over.
+*/
+
+int mpc_parse_arena(const char *filename, const char *string, mpc_arena_t *a, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_arena_t *prev = mpc_arena_current;
+  mpc_arena_current = a;
+  x = mpc_parse(filename, string, p, r);
+  mpc_arena_current = prev;
+  return x;
+}
+
+/*
+** Rather than building anything, a parse with
+** events calls `e->enter` and `e->leave` around
+** each rule of an `mpca_lang` grammar it matches,
+** and `e->token` for each piece of text its
+** strings, chars and regexes would have made a
+** leaf of. This is a walk of the tree `mpc_parse`
+** would return, without the tree, and the output
+** is NULL. Errors come back as usual.
+**
+** Events are only passed on once nothing can
+** backtrack over them, which with no cuts in
+** the grammar means at the very end. Those
+** passed on before a parse fails are not taken
+** back. Packrat memos are not used.
+*/
+
+int mpc_parse_events(const char *filename, const char *string, mpc_parser_t *p, const mpc_events_t *e, void *d, mpc_result_t *r) {
+  
+  int x;
+  mpc_stack_t stk;
+  mpc_event_log_t log;
+  mpc_input_t *i = mpc_input_new_string(filename, string, strlen(string));
+  
+  memset(&log, 0, sizeof(mpc_event_log_t));
+  log.f = e;
+  log.d = d;
+  
+  mpc_stack_init(&stk);
+  stk.events = &log;
+  x = mpc_stack_parse(&stk, i, p, r, 0);
+  if (x) { mpc_stack_events_flush(&stk); }
+  
+  free(log.log);
+  free(log.saves);
+  free(log.text);
+  mpc_stack_trim(&stk);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_file(filename, file);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+  
+  FILE *f = fopen(filename, "rb");
+  int res;
+  
+  if (f == NULL) {
+    r->output = NULL;
+    r->error = mpc_err_fail(filename, mpc_state_new(), "Unable to open file!");
+    return 0;
+  }
+  
+  res = mpc_parse_file(filename, f, p, r);
+  fclose(f);
+  return res;
+}
+
+/*
+** Incremental Parsing
+**
+** A parse context owns the input and the stack
+** of a parse which is still waiting on input.
+** Data is copied into the context as it is fed
+** and the machine is resumed exactly where it
+** ran dry, so nothing is ever parsed twice.
+**
+** Once a parse completes the input it consumed
+** is dropped and the next parse starts from the
+** first unconsumed byte, with its state counted
+** from zero again. After an error all buffered
+** input is discarded.
+**
+** The stack, the input marks and the data buffer
+** all live as long as the context and only grow,
+** so a context reused for many small parses
+** settles down to no setup cost at all. Call
+** `mpc_parse_ctx_trim` to give the memory back.
+*/
+
+struct mpc_parse_ctx_t {
+  mpc_parser_t *parser;
+  mpc_input_t *input;
+  mpc_stack_t stack;
+  int running;
+  char *data;
+  int data_num;
+  int data_slots;
+};
+
+mpc_parse_ctx_t *mpc_parse_ctx_new(const char *filename, mpc_parser_t *p) {
+  mpc_parse_ctx_t *c = malloc(sizeof(mpc_parse_ctx_t));
+  c->parser = p;
+  c->input = mpc_input_new_string(filename, NULL, 0);
+  c->input->partial = 1;
+  mpc_stack_init(&c->stack);
+  c->running = 0;
+  c->data = NULL;
+  c->data_num = 0;
+  c->data_slots = 0;
+  return c;
+}
+
+static int mpc_parse_ctx_run(mpc_parse_ctx_t *c, mpc_result_t *r);
+
+/*
+** A parse still waiting on input is finished so
+** that its partial results get released. Call
+** `mpc_parse_finish` first to collect its result.
+*/
+
+void mpc_parse_ctx_delete(mpc_parse_ctx_t *c) {
+  
+  mpc_result_t r;
+  
+  if (c->running) {
+    c->input->partial = 0;
+    if (mpc_parse_ctx_run(c, &r) == MPC_PARSE_ERROR) { mpc_err_delete(r.error); }
+  }
+  
+  mpc_stack_trim(&c->stack);
+  mpc_input_delete(c->input);
+  free(c->data);
+  free(c);
+}
+
+static void mpc_parse_ctx_restart(mpc_parse_ctx_t *c) {
+  mpc_input_t *i = c->input;
+  i->state = mpc_state_new();
+  i->last = '\0';
+  i->marks_num = 0;
+  i->cut = 0;
+  i->lines_num = 0;
+  i->lines_upto = 0;
+  i->lines_base = 0;
+}
+
+static int mpc_parse_ctx_run(mpc_parse_ctx_t *c, mpc_result_t *r) {
+  
+  mpc_input_t *i = c->input;
+  int x, used;
+  
+  if (!c->running) {
+    if (i->partial && c->data_num == 0) { return MPC_PARSE_MORE; }
+    mpc_stack_begin(&c->stack, i, 0);
+    mpc_stack_pushp(&c->stack, c->parser);
+    c->running = 1;
+  }
+  
+  i->string = c->data;
+  i->length = c->data_num;
+  i->starved = 0;
+  
+  if (!mpc_parse_run(i, &c->stack)) { return MPC_PARSE_MORE; }
+  
+  x = mpc_stack_terminate(&c->stack, r);
+  c->running = 0;
+  
+  used = x ? i->state.pos : c->data_num;
+  if (used > 0) {
+    memmove(c->data, c->data + used, c->data_num - used);
+    c->data_num -= used;
+  }
+  
+  mpc_parse_ctx_restart(c);
+  
+  return x ? MPC_PARSE_DONE : MPC_PARSE_ERROR;
+}
+
+int mpc_parse_feed(mpc_parse_ctx_t *c, const char *data, int length, mpc_result_t *r) {
+  
+  if (c->data_num + length > c->data_slots) {
+    while (c->data_num + length > c->data_slots) {
+      c->data_slots = c->data_slots ? c->data_slots * 2 : 256;
     }
+    c->data = realloc(c->data, c->data_slots);
   }
   
-  return mpc_stack_terminate(stk, final);
+  if (length > 0) {
+    memcpy(c->data + c->data_num, data, length);
+    c->data_num += length;
+  }
   
+  return mpc_parse_ctx_run(c, r);
 }
 
-#undef MPC_CONTINUE
-#undef MPC_SUCCESS
-#undef MPC_FAILURE
-#undef MPC_PRIMATIVE
+int mpc_parse_pending(mpc_parse_ctx_t *c) {
+  return c->running || c->data_num > 0;
+}
 
-int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+int mpc_parse_finish(mpc_parse_ctx_t *c, mpc_result_t *r) {
+  
   int x;
-  mpc_input_t *i = mpc_input_new_string(filename, string);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
+  
+  c->input->partial = 0;
+  x = mpc_parse_ctx_run(c, r);
+  c->input->partial = 1;
+  c->data_num = 0;
+  
   return x;
 }
 
-int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
+/*
+** Parses a whole string in one go, like `mpc_parse_n`,
+** but on the stack and input kept by the context.
+** The string is not copied. This cannot be mixed
+** with a fed parse which is still pending.
+*/
+
+int mpc_parse_ctx_string(mpc_parse_ctx_t *c, const char *string, int length, mpc_result_t *r) {
+  
+  mpc_input_t *i = c->input;
   int x;
-  mpc_input_t *i = mpc_input_new_file(filename, file);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
+  
+  if (mpc_parse_pending(c)) {
+    r->error = mpc_err_fail(i->filename, mpc_state_new(), "Parse Context Busy!");
+    return 0;
+  }
+  
+  i->string = string;
+  i->length = length;
+  i->partial = 0;
+  i->starved = 0;
+  
+  x = mpc_stack_parse(&c->stack, i, c->parser, r, 0);
+  
+  i->string = NULL;
+  i->length = 0;
+  i->partial = 1;
+  mpc_parse_ctx_restart(c);
+  
   return x;
 }
 
-int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
-  x = mpc_parse_input(i, p, r);
+/*
+** Releases everything the context has grown to
+** hold onto. Nothing is released while a fed
+** parse is still pending.
+*/
+
+void mpc_parse_ctx_trim(mpc_parse_ctx_t *c) {
+  
+  mpc_input_t *i = c->input;
+  
+  if (c->running) { return; }
+  
+  mpc_stack_trim(&c->stack);
+  
+  c->data_slots = c->data_num;
+  if (c->data_slots == 0) {
+    free(c->data);
+    c->data = NULL;
+  } else {
+    c->data = realloc(c->data, c->data_slots);
+  }
+  
+  if (i->marks != i->marks_local) {
+    free(i->marks);
+    i->marks = i->marks_local;
+    i->marks_slots = MPC_INPUT_MARKS_MIN;
+  }
+  
+  free(i->lines);
+  i->lines = NULL;
+  i->lines_slots = 0;
+}
+
+/*
+** Parallel Parsing
+**
+** Input made up of many independent top level
+** forms can be cut between the forms and the
+** pieces parsed at the same time. The cuts are
+** found by a quick scan which only balances the
+** pairs of brackets given, so it must not be
+** used where brackets can appear in strings or
+** comments. A cut is only made just after a
+** newline outside of all brackets.
+**
+** Each piece is parsed with `p` as though it
+** were the whole input, but with positions still
+** counted from the start of the real input. The
+** outputs are folded with `f` in order. If any
+** piece fails the error of the first one to fail
+** is returned and the other outputs are destroyed
+** with `d`.
+**
+** Parsing never writes to the parser, so a single
+** graph is shared by all of the workers, each of
+** which has its own input and stack.
+*/
+
+enum {
+  MPC_PARALLEL_MIN   = 4096,
+  MPC_PARALLEL_SPLIT = 8
+};
+
+typedef struct {
+  int start;
+  int end;
+  int rows;
+  int line;
+  int ok;
+  mpc_result_t r;
+} mpc_piece_t;
+
+typedef struct {
+  const char *filename;
+  const char *string;
+  mpc_parser_t *parser;
+  mpc_piece_t *pieces;
+  int pieces_num;
+  int next;
+#ifdef MPC_USE_PTHREAD
+  pthread_mutex_t lock;
+#endif
+} mpc_parallel_t;
+
+static int mpc_parallel_split(mpc_parallel_t *x, int length, const char *brackets, int size) {
+  
+  signed char depth[256];
+  int k, d = 0, rows = 0, line = -1, slots = 16;
+  mpc_piece_t *c;
+  
+  memset(depth, 0, sizeof(depth));
+  for (k = 0; brackets[k] && brackets[k+1]; k += 2) {
+    depth[(unsigned char)brackets[k+0]] =  1;
+    depth[(unsigned char)brackets[k+1]] = -1;
+  }
+  
+  x->pieces = malloc(sizeof(mpc_piece_t) * slots);
+  x->pieces_num = 1;
+  c = &x->pieces[0];
+  c->start = 0;
+  c->rows = 0;
+  c->line = -1;
+  
+  for (k = 0; k < length; k++) {
+    
+    if (x->string[k] == '\n') { rows++; line = k; }
+    
+    /* Unbalanced input is left in one piece to fail */
+    d += depth[(unsigned char)x->string[k]];
+    if (d < 0) { break; }
+    
+    if (d == 0 && x->string[k] == '\n' && k + 1 - c->start >= size && k + 1 < length) {
+      c->end = k + 1;
+      if (x->pieces_num == slots) {
+        slots *= 2;
+        x->pieces = realloc(x->pieces, sizeof(mpc_piece_t) * slots);
+      }
+      c = &x->pieces[x->pieces_num++];
+      c->start = k + 1;
+      c->rows = rows;
+      c->line = line;
+    }
+  }
+  
+  c->end = length;
+  return x->pieces_num;
+}
+
+static int mpc_parallel_next(mpc_parallel_t *x) {
+  int k;
+#ifdef MPC_USE_PTHREAD
+  pthread_mutex_lock(&x->lock);
+#endif
+  k = x->next < x->pieces_num ? x->next++ : -1;
+#ifdef MPC_USE_PTHREAD
+  pthread_mutex_unlock(&x->lock);
+#endif
+  return k;
+}
+
+static void *mpc_parallel_work(void *y) {
+  
+  mpc_parallel_t *x = y;
+  mpc_input_t *i = mpc_input_new_string(x->filename, x->string, 0);
+  mpc_stack_t stk;
+  mpc_piece_t *c;
+  int k;
+  
+  mpc_stack_init(&stk);
+  
+  while ((k = mpc_parallel_next(x)) >= 0) {
+    c = &x->pieces[k];
+    mpc_input_window(i, c->start, c->end, c->rows, c->line);
+    c->ok = mpc_stack_parse(&stk, i, x->parser, &c->r, 0);
+  }
+  
+  mpc_stack_trim(&stk);
   mpc_input_delete(i);
-  return x;
+  return NULL;
 }
 
-int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+int mpc_parse_parallel(const char *filename, const char *string, int length, const char *brackets,
+  int threads, mpc_parser_t *p, mpc_fold_t f, mpc_dtor_t d, mpc_result_t *r) {
   
-  FILE *f = fopen(filename, "rb");
-  int res;
+  mpc_parallel_t x;
+  mpc_val_t **xs;
+  int k, failed = -1;
+#ifdef MPC_USE_PTHREAD
+  pthread_t *workers;
   
-  if (f == NULL) {
-    r->output = NULL;
-    r->error = mpc_err_fail(filename, mpc_state_new(), "Unable to open file!");
+  if (threads <= 0) { threads = (int)sysconf(_SC_NPROCESSORS_ONLN); }
+#endif
+  if (threads <= 0) { threads = 1; }
+  
+  x.filename = filename;
+  x.string = string;
+  x.parser = p;
+  x.next = 0;
+  
+  mpc_parallel_split(&x, length, brackets,
+    MPC_PARALLEL_MIN > length / (threads * MPC_PARALLEL_SPLIT) ? MPC_PARALLEL_MIN : length / (threads * MPC_PARALLEL_SPLIT));
+  
+  if (threads > x.pieces_num) { threads = x.pieces_num; }
+  
+#ifdef MPC_USE_PTHREAD
+  pthread_mutex_init(&x.lock, NULL);
+  workers = malloc(sizeof(pthread_t) * threads);
+  for (k = 1; k < threads; k++) {
+    if (pthread_create(&workers[k], NULL, mpc_parallel_work, &x) != 0) { break; }
+  }
+  threads = k;
+  mpc_parallel_work(&x);
+  for (k = 1; k < threads; k++) { pthread_join(workers[k], NULL); }
+  free(workers);
+  pthread_mutex_destroy(&x.lock);
+#else
+  mpc_parallel_work(&x);
+#endif
+  
+  for (k = 0; k < x.pieces_num; k++) {
+    if (!x.pieces[k].ok) { failed = k; break; }
+  }
+  
+  if (failed >= 0) {
+    r->error = x.pieces[failed].r.error;
+    for (k = 0; k < x.pieces_num; k++) {
+      if (k == failed) { continue; }
+      if (!x.pieces[k].ok) { mpc_err_delete(x.pieces[k].r.error); }
+      else if (d) { d(x.pieces[k].r.output); }
+    }
+    free(x.pieces);
     return 0;
   }
   
-  res = mpc_parse_file(filename, f, p, r);
-  fclose(f);
-  return res;
+  xs = malloc(sizeof(mpc_val_t*) * x.pieces_num);
+  for (k = 0; k < x.pieces_num; k++) { xs[k] = x.pieces[k].r.output; }
+  r->output = f(x.pieces_num, xs);
+  free(xs);
+  free(x.pieces);
+  return 1;
 }
 
 /*
@@ -1228,6 +3926,7 @@ static void mpc_undefine_or(mpc_parser_t *p) {
     mpc_undefine_unretained(p->data.or.xs[i], 0);
   }
   free(p->data.or.xs);
+  free(p->data.or.first);
   
 }
 
@@ -1244,6 +3943,8 @@ static void mpc_undefine_and(mpc_parser_t *p) {
 
 static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
   
+  int i;
+  
   if (p->retained && !force) { return; }
   
   switch (p->type) {
@@ -1259,6 +3960,23 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
     case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
     case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_MEMO:     mpc_undefine_unretained(p->data.memo.x, 0);     break;
+    
+    case MPC_TYPE_DFA:
+      mpc_undefine_unretained(p->data.dfa.x, 0);
+      mpc_dfa_release(p->data.dfa.d);
+      break;
+    
+    case MPC_TYPE_CODE:
+      for (i = 0; i < p->data.code.n; i++) {
+        if (p->data.code.code[i].type == MPC_TYPE_OR)  { free(p->data.code.code[i].data.or.first); }
+        if (p->data.code.code[i].type == MPC_TYPE_DFA) { mpc_dfa_release(p->data.code.code[i].data.dfa.d); }
+      }
+      free(p->data.code.code);
+      free(p->data.code.xs);
+      free(p->data.code.dxs);
+      free(p->data.code.strs);
+      break;
     
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1327,6 +4045,7 @@ mpc_parser_t *mpc_new(const char *name) {
 mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
   mpc_undefine_unretained(p, 1);
   p->type = MPC_TYPE_UNDEFINED;
+  p->mark = 0;
   return p;
 }
 
@@ -1334,6 +4053,7 @@ mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
   
   if (p->retained) {
     p->type = a->type;
+    p->mark = (p->mark & MPC_MARK_RULE) | a->mark;
     p->data = a->data;
   } else {
     mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
@@ -1440,6 +4160,12 @@ mpc_parser_t *mpc_state(void) {
   return p;
 }
 
+mpc_parser_t *mpc_cut(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_CUT;
+  return p;
+}
+
 mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_EXPECT;
@@ -1515,16 +4241,20 @@ mpc_parser_t *mpc_range(char s, char e) {
 mpc_parser_t *mpc_oneof(const char *s) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_ONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
+  p->data.string.n = strlen(s);
+  p->data.string.x = malloc(p->data.string.n + 1);
   strcpy(p->data.string.x, s);
+  mpc_class_build(p->data.string.m, s);
   return mpc_expectf(p, "one of '%s'", s);
 }
 
 mpc_parser_t *mpc_noneof(const char *s) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
+  p->data.string.n = strlen(s);
+  p->data.string.x = malloc(p->data.string.n + 1);
   strcpy(p->data.string.x, s);
+  mpc_class_build(p->data.string.m, s);
   return mpc_expectf(p, "one of '%s'", s);
 
 }
@@ -1539,7 +4269,8 @@ mpc_parser_t *mpc_satisfy(int(*f)(char)) {
 mpc_parser_t *mpc_string(const char *s) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_STRING;
-  p->data.string.x = malloc(strlen(s) + 1);
+  p->data.string.n = strlen(s);
+  p->data.string.x = malloc(p->data.string.n + 1);
   strcpy(p->data.string.x, s);
   return mpc_expectf(p, "\"%s\"", s);
 }
@@ -1572,6 +4303,15 @@ mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
   return p;
 }
 
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_copy_t cp, mpc_dtor_t da) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MEMO;
+  p->data.memo.x = a;
+  p->data.memo.cp = cp;
+  p->data.memo.dx = da;
+  return p;
+}
+
 mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NOT;
@@ -1623,47 +4363,499 @@ mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da) {
   return p;
 }
 
-mpc_parser_t *mpc_or(int n, ...) {
+mpc_parser_t *mpc_or(int n, ...) {
+
+  int i;
+  va_list va;
+
+  mpc_parser_t *p = mpc_undefined();
+  
+  p->type = MPC_TYPE_OR;
+  p->data.or.n = n;
+  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.first = NULL;
+  
+  va_start(va, n);  
+  for (i = 0; i < n; i++) {
+    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  va_end(va);
+  
+  return p;
+}
+
+mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
+
+  int i;
+  va_list va;
+
+  mpc_parser_t *p = mpc_undefined();
+  
+  p->type = MPC_TYPE_AND;
+  p->data.and.n = n;
+  p->data.and.f = f;
+  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+
+  va_start(va, f);  
+  for (i = 0; i < n; i++) {
+    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  for (i = 0; i < (n-1); i++) {
+    p->data.and.dxs[i] = va_arg(va, mpc_dtor_t);
+  }  
+  va_end(va);
+  
+  return p;
+}
+
+/*
+** Compiling a Parser
+**
+** A parser graph is built up a piece at a time
+** so its nodes end up scattered all over the
+** heap. `mpc_compile` lays a finished graph out
+** again as one contiguous array in depth first
+** order, with the children of every `or` and
+** `and` packed into shared arrays and all the
+** literals copied into a single string pool.
+** The machine walks it just as before but stays
+** on far fewer cache lines.
+**
+** The result is a snapshot. Changes made to the
+** original graph afterwards are not seen by it,
+** and it is freed on its own with `mpc_delete`.
+** Tags from `mpca_tag` and `mpca_add_tag` go in
+** the string pool too, but any other data given
+** to `mpc_apply_to` is only pointed at, and must
+** outlive the result.
+*/
+
+typedef struct {
+  int nodes_num;
+  int nodes_slots;
+  mpc_parser_t **nodes;
+  int table_slots;
+  int *table;
+  int children;
+  int dtors;
+  int strings;
+  int roots_num;
+  mpc_parser_t **roots;
+} mpc_compile_t;
+
+static mpc_parser_t *mpc_compile_resolve(mpc_parser_t *p) {
+  while (p->type == MPC_TYPE_CODE) { p = p->data.code.code; }
+  return p;
+}
+
+static int *mpc_compile_slot(mpc_compile_t *c, mpc_parser_t *p) {
+  size_t h = ((size_t)p / sizeof(mpc_parser_t)) & (c->table_slots-1);
+  while (c->table[h] && c->nodes[c->table[h]-1] != p) {
+    h = (h + 1) & (c->table_slots-1);
+  }
+  return &c->table[h];
+}
+
+static void mpc_compile_insert(mpc_compile_t *c, mpc_parser_t *p) {
+  
+  int k, *old = c->table, old_slots = c->table_slots;
+  
+  if ((c->nodes_num+1) * 2 > c->table_slots) {
+    c->table_slots = c->table_slots * 2;
+    c->table = calloc(c->table_slots, sizeof(int));
+    for (k = 0; k < old_slots; k++) {
+      if (old[k]) { *mpc_compile_slot(c, c->nodes[old[k]-1]) = old[k]; }
+    }
+    free(old);
+  }
+  
+  if (c->nodes_num == c->nodes_slots) {
+    c->nodes_slots = c->nodes_slots * 2;
+    c->nodes = realloc(c->nodes, sizeof(mpc_parser_t*) * c->nodes_slots);
+  }
+  
+  c->nodes[c->nodes_num++] = p;
+  *mpc_compile_slot(c, p) = c->nodes_num;
+}
+
+/*
+** When walking with a set of roots, any other
+** retained parser is left as an opaque leaf as
+** it belongs to someone else's grammar.
+*/
+
+static int mpc_compile_opaque(mpc_compile_t *c, mpc_parser_t *p) {
+  int k;
+  if (!c->roots || !p->retained) { return 0; }
+  for (k = 0; k < c->roots_num; k++) {
+    if (c->roots[k] == p) { return 0; }
+  }
+  return 1;
+}
+
+static void mpc_compile_init(mpc_compile_t *c, mpc_parser_t **roots, int roots_num) {
+  c->nodes_num = 0;
+  c->nodes_slots = 32;
+  c->nodes = malloc(sizeof(mpc_parser_t*) * c->nodes_slots);
+  c->table_slots = 64;
+  c->table = calloc(c->table_slots, sizeof(int));
+  c->children = 0;
+  c->dtors = 0;
+  c->strings = 0;
+  c->roots_num = roots_num;
+  c->roots = roots;
+}
+
+static int mpc_compile_tag(mpc_parser_t *p) {
+  return p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_tag
+      || p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_add_tag;
+}
+
+static void mpc_compile_visit(mpc_compile_t *c, mpc_parser_t *p) {
+  
+  int k;
+  
+  p = mpc_compile_resolve(p);
+  if (*mpc_compile_slot(c, p)) { return; }
+  mpc_compile_insert(c, p);
+  
+  if (mpc_compile_opaque(c, p)) { return; }
+  
+  if (p->name) { c->strings += strlen(p->name) + 1; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_FAIL: c->strings += strlen(p->data.fail.m) + 1; break;
+    
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      c->strings += strlen(p->data.string.x) + 1;
+      break;
+    
+    case MPC_TYPE_EXPECT:
+      c->strings += strlen(p->data.expect.m) + 1;
+      mpc_compile_visit(c, p->data.expect.x);
+      break;
+    
+    case MPC_TYPE_APPLY:    mpc_compile_visit(c, p->data.apply.x);    break;
+    case MPC_TYPE_APPLY_TO:
+      if (mpc_compile_tag(p)) { c->strings += strlen(p->data.apply_to.d) + 1; }
+      mpc_compile_visit(c, p->data.apply_to.x);
+      break;
+    
+    case MPC_TYPE_PREDICT:  mpc_compile_visit(c, p->data.predict.x);  break;
+    case MPC_TYPE_MEMO:     mpc_compile_visit(c, p->data.memo.x);     break;
+    case MPC_TYPE_DFA:      mpc_compile_visit(c, p->data.dfa.x);      break;
+    
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_NOT:
+      mpc_compile_visit(c, p->data.not.x);
+      break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_compile_visit(c, p->data.repeat.x);
+      break;
+    
+    case MPC_TYPE_OR:
+      c->children += p->data.or.n;
+      for (k = 0; k < p->data.or.n; k++) { mpc_compile_visit(c, p->data.or.xs[k]); }
+      break;
+    
+    case MPC_TYPE_AND:
+      c->children += p->data.and.n;
+      c->dtors += p->data.and.n > 0 ? p->data.and.n-1 : 0;
+      for (k = 0; k < p->data.and.n; k++) { mpc_compile_visit(c, p->data.and.xs[k]); }
+      break;
+    
+    default: break;
+  }
+  
+}
+
+static mpc_parser_t *mpc_compile_child(mpc_compile_t *c, mpc_parser_t *code, mpc_parser_t *x) {
+  return &code[*mpc_compile_slot(c, mpc_compile_resolve(x))-1];
+}
+
+static char *mpc_compile_string(char **strs, const char *x) {
+  char *y = *strs;
+  strcpy(y, x);
+  *strs += strlen(x) + 1;
+  return y;
+}
+
+/*
+** FIRST Sets
+**
+** For every parser we work out the set of bytes
+** which can start a match, and whether it can
+** succeed without consuming anything at all. A
+** parser which cannot be empty, and whose set
+** misses the next byte, is certain to fail right
+** there without moving the input. So each `or`
+** keeps the sets of its alternatives and while
+** parsing quietly skips such alternatives rather
+** than trying them. A loud parse tries everything
+** as it always did, so its messages are unchanged.
+**
+** Sets are found by iterating to a fixed point
+** as grammars are usually recursive. Anything
+** not known for sure, such as undefined or
+** opaque parsers, can match anything. The sets
+** are worked out when a grammar is finished, by
+** `mpca_lang` and `mpc_compile`, and so go stale
+** if the rules are redefined afterwards.
+*/
+
+static void mpc_first_all(unsigned char *x, int nullable) {
+  memset(x, 0xFF, 32);
+  x[MPC_FIRST_NULLABLE] = nullable;
+}
+
+static void mpc_first_merge(unsigned char *x, unsigned char *y, int nullable) {
+  int k;
+  for (k = 0; k < 32; k++) { x[k] |= y[k]; }
+  if (nullable) { x[MPC_FIRST_NULLABLE] |= y[MPC_FIRST_NULLABLE]; }
+}
 
-  int i;
-  va_list va;
+static unsigned char *mpc_first_of(mpc_compile_t *c, unsigned char *sets, mpc_parser_t *x) {
+  return sets + (*mpc_compile_slot(c, mpc_compile_resolve(x))-1) * MPC_FIRST_SIZE;
+}
 
-  mpc_parser_t *p = mpc_undefined();
+static void mpc_first_node(mpc_compile_t *c, unsigned char *sets, mpc_parser_t *p, unsigned char *x) {
   
-  p->type = MPC_TYPE_OR;
-  p->data.or.n = n;
-  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  int k;
+  unsigned char *y;
   
-  va_start(va, n);  
-  for (i = 0; i < n; i++) {
-    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+  if (mpc_compile_opaque(c, p)) { mpc_first_all(x, 1); return; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_UNDEFINED: mpc_first_all(x, 1); break;
+    case MPC_TYPE_ANY:       mpc_first_all(x, 0); break;
+    case MPC_TYPE_SATISFY:   mpc_first_all(x, 0); break;
+    case MPC_TYPE_FAIL:      break;
+    
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_CUT:
+      x[MPC_FIRST_NULLABLE] = 1;
+      break;
+    
+    case MPC_TYPE_SINGLE: MPC_CLASS_ADD(x, p->data.single.x); break;
+    case MPC_TYPE_ONEOF:  memcpy(x, p->data.string.m, 32); break;
+    
+    case MPC_TYPE_NONEOF:
+      for (k = 0; k < 32; k++) { x[k] = ~p->data.string.m[k]; }
+      MPC_CLASS_ADD(x, '\0');
+      break;
+    
+    case MPC_TYPE_RANGE:
+      for (k = 0; k < 256; k++) {
+        if ((char)k >= p->data.range.x && (char)k <= p->data.range.y) { MPC_CLASS_ADD(x, k); }
+      }
+      break;
+    
+    case MPC_TYPE_STRING:
+      if (p->data.string.n == 0) { x[MPC_FIRST_NULLABLE] = 1; }
+      else { MPC_CLASS_ADD(x, p->data.string.x[0]); }
+      break;
+    
+    case MPC_TYPE_EXPECT:   mpc_first_merge(x, mpc_first_of(c, sets, p->data.expect.x), 1);   break;
+    case MPC_TYPE_APPLY:    mpc_first_merge(x, mpc_first_of(c, sets, p->data.apply.x), 1);    break;
+    case MPC_TYPE_APPLY_TO: mpc_first_merge(x, mpc_first_of(c, sets, p->data.apply_to.x), 1); break;
+    case MPC_TYPE_PREDICT:  mpc_first_merge(x, mpc_first_of(c, sets, p->data.predict.x), 1);  break;
+    case MPC_TYPE_MEMO:     mpc_first_merge(x, mpc_first_of(c, sets, p->data.memo.x), 1);     break;
+    case MPC_TYPE_DFA:      mpc_first_merge(x, mpc_first_of(c, sets, p->data.dfa.x), 1);      break;
+    case MPC_TYPE_MANY1:    mpc_first_merge(x, mpc_first_of(c, sets, p->data.repeat.x), 1);   break;
+    
+    case MPC_TYPE_MAYBE:
+      mpc_first_merge(x, mpc_first_of(c, sets, p->data.not.x), 0);
+      x[MPC_FIRST_NULLABLE] = 1;
+      break;
+    
+    case MPC_TYPE_MANY:
+      mpc_first_merge(x, mpc_first_of(c, sets, p->data.repeat.x), 0);
+      x[MPC_FIRST_NULLABLE] = 1;
+      break;
+    
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.n == 0) { x[MPC_FIRST_NULLABLE] = 1; }
+      else { mpc_first_merge(x, mpc_first_of(c, sets, p->data.repeat.x), 1); }
+      break;
+    
+    case MPC_TYPE_OR:
+      for (k = 0; k < p->data.or.n; k++) {
+        mpc_first_merge(x, mpc_first_of(c, sets, p->data.or.xs[k]), 1);
+      }
+      if (p->data.or.n == 0) { x[MPC_FIRST_NULLABLE] = 1; }
+      break;
+    
+    case MPC_TYPE_AND:
+      x[MPC_FIRST_NULLABLE] = 1;
+      for (k = 0; k < p->data.and.n; k++) {
+        y = mpc_first_of(c, sets, p->data.and.xs[k]);
+        mpc_first_merge(x, y, 0);
+        if (!y[MPC_FIRST_NULLABLE]) { x[MPC_FIRST_NULLABLE] = 0; break; }
+      }
+      break;
+    
+    default: mpc_first_all(x, 1); break;
   }
-  va_end(va);
   
-  return p;
 }
 
-mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
-
-  int i;
-  va_list va;
-
-  mpc_parser_t *p = mpc_undefined();
+static void mpc_first(mpc_parser_t *a, mpc_parser_t **roots, int roots_num) {
   
-  p->type = MPC_TYPE_AND;
-  p->data.and.n = n;
-  p->data.and.f = f;
-  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
-  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+  int k, j, changed;
+  mpc_compile_t c;
+  mpc_parser_t *p;
+  unsigned char *sets, *y;
+  unsigned char x[MPC_FIRST_SIZE];
+  
+  mpc_compile_init(&c, roots, roots_num);
+  if (roots) {
+    for (k = 0; k < roots_num; k++) { mpc_compile_visit(&c, roots[k]); }
+  } else {
+    mpc_compile_visit(&c, a);
+  }
+  
+  sets = calloc(c.nodes_num, MPC_FIRST_SIZE);
+  
+  do {
+    changed = 0;
+    for (k = 0; k < c.nodes_num; k++) {
+      y = sets + k * MPC_FIRST_SIZE;
+      memcpy(x, y, MPC_FIRST_SIZE);
+      mpc_first_node(&c, sets, c.nodes[k], x);
+      if (memcmp(x, y, MPC_FIRST_SIZE) != 0) {
+        memcpy(y, x, MPC_FIRST_SIZE);
+        changed = 1;
+      }
+    }
+  } while (changed);
+  
+  for (k = 0; k < c.nodes_num; k++) {
+    p = c.nodes[k];
+    if (p->type != MPC_TYPE_OR || mpc_compile_opaque(&c, p)) { continue; }
+    free(p->data.or.first);
+    p->data.or.first = malloc(MPC_FIRST_SIZE * (p->data.or.n ? p->data.or.n : 1));
+    for (j = 0; j < p->data.or.n; j++) {
+      memcpy(p->data.or.first + j * MPC_FIRST_SIZE, mpc_first_of(&c, sets, p->data.or.xs[j]), MPC_FIRST_SIZE);
+    }
+  }
+  
+  free(sets);
+  free(c.nodes);
+  free(c.table);
+}
 
-  va_start(va, f);  
-  for (i = 0; i < n; i++) {
-    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+mpc_parser_t *mpc_compile(mpc_parser_t *a) {
+  
+  int k, j;
+  mpc_compile_t c;
+  mpc_parser_t *p, *q, *code, **xs;
+  mpc_dtor_t *dxs;
+  char *strs;
+  
+  mpc_compile_init(&c, NULL, 0);
+  mpc_compile_visit(&c, a);
+  
+  p = mpc_undefined();
+  p->type = MPC_TYPE_CODE;
+  p->data.code.n = c.nodes_num;
+  p->data.code.code = malloc(sizeof(mpc_parser_t) * c.nodes_num);
+  p->data.code.xs = c.children ? malloc(sizeof(mpc_parser_t*) * c.children) : NULL;
+  p->data.code.dxs = c.dtors ? malloc(sizeof(mpc_dtor_t) * c.dtors) : NULL;
+  p->data.code.strs = c.strings ? malloc(c.strings) : NULL;
+  
+  code = p->data.code.code;
+  xs = p->data.code.xs;
+  dxs = p->data.code.dxs;
+  strs = p->data.code.strs;
+  
+  for (k = 0; k < c.nodes_num; k++) {
+    
+    q = &code[k];
+    *q = *c.nodes[k];
+    q->retained = 1;
+#ifdef MPC_PROFILE
+    mpc_profile_reset(q);
+#endif
+    
+    if (q->name) { q->name = mpc_compile_string(&strs, q->name); }
+    
+    switch (q->type) {
+      
+      case MPC_TYPE_FAIL: q->data.fail.m = mpc_compile_string(&strs, q->data.fail.m); break;
+      
+      case MPC_TYPE_ONEOF:
+      case MPC_TYPE_NONEOF:
+      case MPC_TYPE_STRING:
+        q->data.string.x = mpc_compile_string(&strs, q->data.string.x);
+        break;
+      
+      case MPC_TYPE_EXPECT:
+        q->data.expect.m = mpc_compile_string(&strs, q->data.expect.m);
+        q->data.expect.x = mpc_compile_child(&c, code, q->data.expect.x);
+        break;
+      
+      case MPC_TYPE_APPLY:    q->data.apply.x    = mpc_compile_child(&c, code, q->data.apply.x);    break;
+      case MPC_TYPE_APPLY_TO:
+        if (mpc_compile_tag(q)) { q->data.apply_to.d = mpc_compile_string(&strs, q->data.apply_to.d); }
+        q->data.apply_to.x = mpc_compile_child(&c, code, q->data.apply_to.x);
+        break;
+      
+      case MPC_TYPE_PREDICT:  q->data.predict.x  = mpc_compile_child(&c, code, q->data.predict.x);  break;
+      case MPC_TYPE_MEMO:     q->data.memo.x     = mpc_compile_child(&c, code, q->data.memo.x);     break;
+      
+      case MPC_TYPE_DFA:
+        q->data.dfa.x = mpc_compile_child(&c, code, q->data.dfa.x);
+        q->data.dfa.d = mpc_dfa_retain(q->data.dfa.d);
+        break;
+      
+      case MPC_TYPE_MAYBE:
+      case MPC_TYPE_NOT:
+        q->data.not.x = mpc_compile_child(&c, code, q->data.not.x);
+        break;
+      
+      case MPC_TYPE_MANY:
+      case MPC_TYPE_MANY1:
+      case MPC_TYPE_COUNT:
+        q->data.repeat.x = mpc_compile_child(&c, code, q->data.repeat.x);
+        break;
+      
+      case MPC_TYPE_OR:
+        for (j = 0; j < q->data.or.n; j++) { xs[j] = mpc_compile_child(&c, code, q->data.or.xs[j]); }
+        q->data.or.xs = xs;
+        q->data.or.first = NULL;
+        xs += q->data.or.n;
+        break;
+      
+      case MPC_TYPE_AND:
+        for (j = 0; j < q->data.and.n; j++) { xs[j] = mpc_compile_child(&c, code, q->data.and.xs[j]); }
+        for (j = 0; j < q->data.and.n-1; j++) { dxs[j] = q->data.and.dxs[j]; }
+        q->data.and.xs = xs;
+        q->data.and.dxs = dxs;
+        xs += q->data.and.n;
+        dxs += q->data.and.n > 0 ? q->data.and.n-1 : 0;
+        break;
+      
+      default: break;
+    }
   }
-  for (i = 0; i < (n-1); i++) {
-    p->data.and.dxs[i] = va_arg(va, mpc_dtor_t);
-  }  
-  va_end(va);
+  
+  free(c.nodes);
+  free(c.table);
+  
+  mpc_first(code, NULL, 0);
   
   return p;
 }
@@ -1697,7 +4889,7 @@ mpc_parser_t *mpc_blank(void) { return mpc_expect(mpc_apply(mpc_whitespaces(), m
 
 mpc_parser_t *mpc_newline(void) { return mpc_expect(mpc_char('\n'), "newline"); }
 mpc_parser_t *mpc_tab(void) { return mpc_expect(mpc_char('\t'), "tab"); }
-mpc_parser_t *mpc_escape(void) { return mpc_and(2, mpcf_strfold, mpc_char('\\'), mpc_any(), free); }
+mpc_parser_t *mpc_escape(void) { return mpc_and(2, mpcf_strfold, mpc_char('\\'), mpc_any(), mpc_free); }
 
 mpc_parser_t *mpc_digit(void) { return mpc_expect(mpc_oneof("0123456789"), "digit"); }
 mpc_parser_t *mpc_hexdigit(void) { return mpc_expect(mpc_oneof("0123456789ABCDEFabcdef"), "hex digit"); }
@@ -1725,13 +4917,13 @@ mpc_parser_t *mpc_real(void) {
   
   p0 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
   p1 = mpc_digits();
-  p2 = mpc_maybe_lift(mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_digits(), free), mpcf_ctor_str);
+  p2 = mpc_maybe_lift(mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_digits(), mpc_free), mpcf_ctor_str);
   p30 = mpc_oneof("eE");
   p31 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
   p32 = mpc_digits();
-  p3 = mpc_maybe_lift(mpc_and(3, mpcf_strfold, p30, p31, p32, free, free), mpcf_ctor_str);
+  p3 = mpc_maybe_lift(mpc_and(3, mpcf_strfold, p30, p31, p32, mpc_free, mpc_free), mpcf_ctor_str);
   
-  return mpc_expect(mpc_and(4, mpcf_strfold, p0, p1, p2, p3, free, free, free), "real");
+  return mpc_expect(mpc_and(4, mpcf_strfold, p0, p1, p2, p3, mpc_free, mpc_free, mpc_free), "real");
 
 }
 
@@ -1740,24 +4932,24 @@ mpc_parser_t *mpc_float(void) {
 }
 
 mpc_parser_t *mpc_char_lit(void) {
-  return mpc_expect(mpc_between(mpc_or(2, mpc_escape(), mpc_any()), free, "'", "'"), "char");
+  return mpc_expect(mpc_between(mpc_or(2, mpc_escape(), mpc_any()), mpc_free, "'", "'"), "char");
 }
 
 mpc_parser_t *mpc_string_lit(void) {
   mpc_parser_t *strchar = mpc_or(2, mpc_escape(), mpc_noneof("\""));
-  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, strchar), free, "\"", "\""), "string");
+  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, strchar), mpc_free, "\"", "\""), "string");
 }
 
 mpc_parser_t *mpc_regex_lit(void) {  
   mpc_parser_t *regexchar = mpc_or(2, mpc_escape(), mpc_noneof("/"));
-  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, regexchar), free, "/", "/"), "regex");
+  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, regexchar), mpc_free, "/", "/"), "regex");
 }
 
 mpc_parser_t *mpc_ident(void) {
   mpc_parser_t *p0, *p1; 
   p0 = mpc_or(2, mpc_alpha(), mpc_underscore());
   p1 = mpc_many(mpcf_strfold, mpc_alphanum()); 
-  return mpc_and(2, mpcf_strfold, p0, p1, free);
+  return mpc_and(2, mpcf_strfold, p0, p1, mpc_free);
 }
 
 /*
@@ -1857,7 +5049,7 @@ static mpc_val_t *mpcf_re_and(int n, mpc_val_t **xs) {
   int i;
   mpc_parser_t *p = mpc_lift(mpcf_ctor_str);
   for (i = 0; i < n; i++) {
-    p = mpc_and(2, mpcf_strfold, p, xs[i], free);
+    p = mpc_and(2, mpcf_strfold, p, xs[i], mpc_free);
   }
   return p;
 }
@@ -1872,7 +5064,7 @@ static mpc_val_t *mpcf_re_repeat(int n, mpc_val_t **xs) {
   num = *(int*)xs[1];
   free(xs[1]);
   
-  return mpc_count(num, mpcf_strfold, xs[0], free);
+  return mpc_count(num, mpcf_strfold, xs[0], mpc_free);
 }
 
 static mpc_parser_t *mpc_re_escape_char(char c) {
@@ -1883,16 +5075,16 @@ static mpc_parser_t *mpc_re_escape_char(char c) {
     case 'r': return mpc_char('\r');
     case 't': return mpc_char('\t');
     case 'v': return mpc_char('\v');
-    case 'b': return mpc_and(2, mpcf_snd, mpc_boundary(), mpc_lift(mpcf_ctor_str), free);
-    case 'B': return mpc_not_lift(mpc_boundary(), free, mpcf_ctor_str);
-    case 'A': return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
-    case 'Z': return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free);
+    case 'b': return mpc_and(2, mpcf_snd, mpc_boundary(), mpc_lift(mpcf_ctor_str), mpc_free);
+    case 'B': return mpc_not_lift(mpc_boundary(), mpc_free, mpcf_ctor_str);
+    case 'A': return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), mpc_free);
+    case 'Z': return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), mpc_free);
     case 'd': return mpc_digit();
-    case 'D': return mpc_not_lift(mpc_digit(), free, mpcf_ctor_str);
+    case 'D': return mpc_not_lift(mpc_digit(), mpc_free, mpcf_ctor_str);
     case 's': return mpc_whitespace();
-    case 'S': return mpc_not_lift(mpc_whitespace(), free, mpcf_ctor_str);
+    case 'S': return mpc_not_lift(mpc_whitespace(), mpc_free, mpcf_ctor_str);
     case 'w': return mpc_alphanum();
-    case 'W': return mpc_not_lift(mpc_alphanum(), free, mpcf_ctor_str);
+    case 'W': return mpc_not_lift(mpc_alphanum(), mpc_free, mpcf_ctor_str);
     default: return NULL;
   }
 }
@@ -1904,8 +5096,8 @@ static mpc_val_t *mpcf_re_escape(mpc_val_t *x) {
   
   /* Regex Special Characters */
   if (s[0] == '.') { free(s); return mpc_any(); }
-  if (s[0] == '^') { free(s); return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free); }
-  if (s[0] == '$') { free(s); return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free); }
+  if (s[0] == '^') { free(s); return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), mpc_free); }
+  if (s[0] == '$') { free(s); return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), mpc_free); }
   
   /* Regex Escape */
   if (s[0] == '\\') {
@@ -1940,70 +5132,445 @@ static char *mpc_re_range_escape_char(char c) {
 
 static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   
-  mpc_parser_t *out;
-  char *range = calloc(1,1);
-  char *tmp = NULL;
-  char *s = x;
-  char start, end;
-  int i, j;
-  int comp = 0;
+  mpc_parser_t *out;
+  char *range = calloc(1,1);
+  char *tmp = NULL;
+  char *s = x;
+  char start, end;
+  int i, j;
+  int comp = 0;
+  
+  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
+  if (s[0] == '^' && 
+      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  
+  if (s[0] == '^') { comp = 1;}
+  
+  for (i = comp; i < strlen(s); i++){
+    
+    /* Regex Range Escape */
+    if (s[i] == '\\') {
+      tmp = mpc_re_range_escape_char(s[i+1]);
+      if (tmp != NULL) {
+        range = realloc(range, strlen(range) + strlen(tmp) + 1);
+        strcat(range, tmp);
+      } else {
+        range = realloc(range, strlen(range) + 1 + 1);
+        range[strlen(range) + 1] = '\0';
+        range[strlen(range) + 0] = s[i+1];      
+      }
+      i++;
+    }
+    
+    /* Regex Range...Range */
+    else if (s[i] == '-') {
+      if (s[i+1] == '\0' || i == 0) {
+          range = realloc(range, strlen(range) + strlen("-") + 1);
+          strcat(range, "-");
+      } else {
+        start = s[i-1]+1;
+        end = s[i+1]-1;
+        for (j = start; j <= end; j++) {
+          range = realloc(range, strlen(range) + 1 + 1);
+          range[strlen(range) + 1] = '\0';
+          range[strlen(range) + 0] = j;
+        }        
+      }
+    }
+    
+    /* Regex Range Normal */
+    else {
+      range = realloc(range, strlen(range) + 1 + 1);
+      range[strlen(range) + 1] = '\0';
+      range[strlen(range) + 0] = s[i];
+    }
+  
+  }
+  
+  out = comp ? mpc_noneof(range) : mpc_oneof(range);
+  
+  free(x);
+  free(range);
+  
+  return out;
+}
+
+/*
+** Compiling Regexes
+**
+** Most regexes people write are deterministic. At
+** each choice the next character alone decides
+** which way to go, and then the combinators above
+** always find the longest match. Such regexes can
+** also be matched by one of the automata above
+** without any backtracking or allocation.
+**
+** The combinators are first checked for this. An
+** option or repeat must not be able to match nothing
+** or start with anything that might follow it, and
+** the choices of an `or` must each start with
+** different characters. Only single characters may
+** be counted. Anchors and negations are never
+** compiled, and neither is anything too large.
+**
+** What passes is built into a Thompson NFA back to
+** front. The combinators are kept alongside for
+** everything the automata don't do, such as
+** reporting errors.
+*/
+
+#define MPC_NFA_MAX 8192
+#define MPC_DFA_MAX 512
+
+static size_t mpc_re_budget = 1 << 20;
+
+/* Sets the most memory each lazily built DFA may use, for regexes compiled after */
+void mpc_re_dfa_budget(size_t bytes) {
+  mpc_re_budget = bytes;
+}
+
+/* Fills `m` with what a single character parser accepts, or returns zero if `p` isn't one */
+static int mpc_re_class(mpc_parser_t *p, unsigned char *m) {
+  
+  int k;
+  memset(m, 0, 32);
+  
+  switch (p->type) {
+    case MPC_TYPE_ANY:    memset(m, 0xFF, 32); break;
+    case MPC_TYPE_SINGLE: MPC_CLASS_ADD(m, p->data.single.x); break;
+    case MPC_TYPE_ONEOF:  memcpy(m, p->data.string.m, 32); break;
+    case MPC_TYPE_NONEOF: for (k = 0; k < 32; k++) { m[k] = ~p->data.string.m[k]; } break;
+    case MPC_TYPE_RANGE:
+      for (k = 0; k < 256; k++) {
+        if ((char)k >= p->data.range.x && (char)k <= p->data.range.y) { MPC_CLASS_ADD(m, k); }
+      }
+      break;
+    default: return 0;
+  }
+  
+  m[0] &= ~1;
+  return 1;
+}
+
+static mpc_parser_t *mpc_re_single(mpc_parser_t *p) {
+  return p->type == MPC_TYPE_EXPECT ? p->data.expect.x : p;
+}
+
+static int mpc_re_disjoint(const unsigned char *x, const unsigned char *y) {
+  int k;
+  for (k = 0; k < 32; k++) { if (x[k] & y[k]) { return 0; } }
+  return 1;
+}
+
+/* Adds what `p` can start with to `m` and returns if it can match nothing */
+static int mpc_re_first(mpc_parser_t *p, unsigned char *m) {
+  
+  int k, nullable;
+  unsigned char x[32];
+  
+  if (mpc_re_class(p, x)) {
+    for (k = 0; k < 32; k++) { m[k] |= x[k]; }
+    return 0;
+  }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_STRING:
+      if (p->data.string.n == 0) { return 1; }
+      MPC_CLASS_ADD(m, p->data.string.x[0]);
+      return 0;
+    
+    case MPC_TYPE_EXPECT: return mpc_re_first(p->data.expect.x, m);
+    case MPC_TYPE_MANY1:  return mpc_re_first(p->data.repeat.x, m);
+    case MPC_TYPE_COUNT:  mpc_re_first(p->data.repeat.x, m); return p->data.repeat.n == 0;
+    case MPC_TYPE_MANY:   mpc_re_first(p->data.repeat.x, m); return 1;
+    case MPC_TYPE_MAYBE:  mpc_re_first(p->data.not.x, m);    return 1;
+    
+    case MPC_TYPE_OR:
+      nullable = 0;
+      for (k = 0; k < p->data.or.n; k++) { nullable |= mpc_re_first(p->data.or.xs[k], m); }
+      return nullable;
+    
+    case MPC_TYPE_AND:
+      for (k = 0; k < p->data.and.n; k++) {
+        if (!mpc_re_first(p->data.and.xs[k], m)) { return 0; }
+      }
+      return 1;
+    
+    default: return 1;
+  }
+  
+}
+
+/* Checks `p` can be compiled when followed by something starting with `follow` */
+static int mpc_re_check(mpc_parser_t *p, const unsigned char *follow) {
+  
+  int k, j, nullable;
+  unsigned char x[32], f[32], all[32];
+  
+  if (mpc_re_class(p, x)) { return 1; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_LIFT:   return p->data.lift.lf == mpcf_ctor_str;
+    case MPC_TYPE_STRING: return 1;
+    case MPC_TYPE_EXPECT: return mpc_re_check(p->data.expect.x, follow);
+    
+    case MPC_TYPE_MAYBE:
+      if (p->data.not.lf != mpcf_ctor_str) { return 0; }
+      memset(x, 0, 32);
+      if (mpc_re_first(p->data.not.x, x) || !mpc_re_disjoint(x, follow)) { return 0; }
+      return mpc_re_check(p->data.not.x, follow);
+    
+    /* A count fails if one more follows so is decided by a guard on the next character */
+    
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.f != mpcf_strfold || p->data.repeat.n < 1) { return 0; }
+      return mpc_re_class(mpc_re_single(p->data.repeat.x), x);
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      if (p->data.repeat.f != mpcf_strfold) { return 0; }
+      memset(x, 0, 32);
+      if (mpc_re_first(p->data.repeat.x, x) || !mpc_re_disjoint(x, follow)) { return 0; }
+      for (k = 0; k < 32; k++) { f[k] = x[k] | follow[k]; }
+      return mpc_re_check(p->data.repeat.x, f);
+    
+    /* Only the last choice may match nothing, as otherwise later ones are never tried */
+    
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { return 0; }
+      memset(all, 0, 32);
+      nullable = 0;
+      for (k = 0; k < p->data.or.n; k++) {
+        memset(x, 0, 32);
+        nullable = mpc_re_first(p->data.or.xs[k], x);
+        if (nullable && k != p->data.or.n-1) { return 0; }
+        if (!mpc_re_disjoint(x, all)) { return 0; }
+        if (!mpc_re_check(p->data.or.xs[k], follow)) { return 0; }
+        for (j = 0; j < 32; j++) { all[j] |= x[j]; }
+      }
+      return !nullable || mpc_re_disjoint(all, follow);
+    
+    case MPC_TYPE_AND:
+      if (p->data.and.f != mpcf_strfold) { return 0; }
+      memcpy(f, follow, 32);
+      for (k = p->data.and.n-1; k >= 0; k--) {
+        if (!mpc_re_check(p->data.and.xs[k], f)) { return 0; }
+        memset(x, 0, 32);
+        if (mpc_re_first(p->data.and.xs[k], x)) {
+          for (j = 0; j < 32; j++) { f[j] |= x[j]; }
+        } else {
+          memcpy(f, x, 32);
+        }
+      }
+      return 1;
+    
+    default: return 0;
+  }
+  
+}
+
+static int mpc_nfa_add(mpc_nfa_t *a, int type, int out, int out1) {
+  
+  mpc_nfa_state_t *x;
+  
+  if (a->num == MPC_NFA_MAX) { return -1; }
+  if (a->num == a->slots) {
+    a->slots = a->slots ? a->slots * 2 : 16;
+    a->states = realloc(a->states, sizeof(mpc_nfa_state_t) * a->slots);
+  }
+  
+  x = &a->states[a->num];
+  x->type = type;
+  x->out = out;
+  x->out1 = out1;
+  memset(x->m, 0, 32);
+  return a->num++;
+}
+
+/* Builds the states for `p` leading on to `next` and returns the first, or -1 if too large */
+static int mpc_nfa_build(mpc_nfa_t *a, mpc_parser_t *p, int next) {
+  
+  int k, s, l;
+  unsigned char m[32];
   
-  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
-  if (s[0] == '^' && 
-      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  if (next < 0) { return -1; }
   
-  if (s[0] == '^') { comp = 1;}
+  if (mpc_re_class(p, m)) {
+    s = mpc_nfa_add(a, MPC_NFA_CLASS, next, -1);
+    if (s >= 0) { memcpy(a->states[s].m, m, 32); }
+    return s;
+  }
   
-  for (i = comp; i < strlen(s); i++){
+  switch (p->type) {
     
-    /* Regex Range Escape */
-    if (s[i] == '\\') {
-      tmp = mpc_re_range_escape_char(s[i+1]);
-      if (tmp != NULL) {
-        range = realloc(range, strlen(range) + strlen(tmp) + 1);
-        strcat(range, tmp);
-      } else {
-        range = realloc(range, strlen(range) + 1 + 1);
-        range[strlen(range) + 1] = '\0';
-        range[strlen(range) + 0] = s[i+1];      
+    case MPC_TYPE_LIFT: return next;
+    
+    case MPC_TYPE_STRING:
+      for (k = p->data.string.n-1; k >= 0 && next >= 0; k--) {
+        next = mpc_nfa_add(a, MPC_NFA_CLASS, next, -1);
+        if (next >= 0) { MPC_CLASS_ADD(a->states[next].m, p->data.string.x[k]); }
       }
-      i++;
-    }
+      return next;
     
-    /* Regex Range...Range */
-    else if (s[i] == '-') {
-      if (s[i+1] == '\0' || i == 0) {
-          range = realloc(range, strlen(range) + strlen("-") + 1);
-          strcat(range, "-");
-      } else {
-        start = s[i-1]+1;
-        end = s[i+1]-1;
-        for (j = start; j <= end; j++) {
-          range = realloc(range, strlen(range) + 1 + 1);
-          range[strlen(range) + 1] = '\0';
-          range[strlen(range) + 0] = j;
-        }        
+    case MPC_TYPE_EXPECT: return mpc_nfa_build(a, p->data.expect.x, next);
+    
+    case MPC_TYPE_COUNT:
+      mpc_re_class(mpc_re_single(p->data.repeat.x), m);
+      next = mpc_nfa_add(a, MPC_NFA_GUARD, next, -1);
+      for (k = 0; k < p->data.repeat.n && next >= 0; k++) {
+        memcpy(a->states[next].m, m, 32);
+        next = mpc_nfa_add(a, MPC_NFA_CLASS, next, -1);
       }
-    }
+      if (next >= 0) { memcpy(a->states[next].m, m, 32); }
+      return next;
     
-    /* Regex Range Normal */
-    else {
-      range = realloc(range, strlen(range) + 1 + 1);
-      range[strlen(range) + 1] = '\0';
-      range[strlen(range) + 0] = s[i];
+    case MPC_TYPE_MAYBE:
+      s = mpc_nfa_build(a, p->data.not.x, next);
+      return s < 0 ? -1 : mpc_nfa_add(a, MPC_NFA_SPLIT, s, next);
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      l = mpc_nfa_add(a, MPC_NFA_SPLIT, -1, next);
+      s = mpc_nfa_build(a, p->data.repeat.x, l);
+      if (s < 0) { return -1; }
+      a->states[l].out = s;
+      return p->type == MPC_TYPE_MANY ? l : s;
+    
+    case MPC_TYPE_OR:
+      s = mpc_nfa_build(a, p->data.or.xs[p->data.or.n-1], next);
+      for (k = p->data.or.n-2; k >= 0 && s >= 0; k--) {
+        l = mpc_nfa_build(a, p->data.or.xs[k], next);
+        s = l < 0 ? -1 : mpc_nfa_add(a, MPC_NFA_SPLIT, l, s);
+      }
+      return s;
+    
+    case MPC_TYPE_AND:
+      for (k = p->data.and.n-1; k >= 0 && next >= 0; k--) {
+        next = mpc_nfa_build(a, p->data.and.xs[k], next);
+      }
+      return next;
+    
+    default: return -1;
+  }
+  
+}
+
+/* Splits the bytes into classes no state tells apart and picks one byte from each */
+static int mpc_nfa_classes(const mpc_nfa_t *a, unsigned char *cls, int *reps) {
+  
+  int k, j, key, num = 1;
+  int map[512];
+  
+  memset(cls, 0, 256);
+  
+  for (k = 0; k < a->num; k++) {
+    if (a->states[k].type != MPC_NFA_CLASS && a->states[k].type != MPC_NFA_GUARD) { continue; }
+    for (j = 0; j < 512; j++) { map[j] = -1; }
+    num = 0;
+    for (j = 0; j < 256; j++) {
+      key = cls[j] * 2 + (MPC_CLASS_HAS(a->states[k].m, j) ? 1 : 0);
+      if (map[key] < 0) { map[key] = num++; }
+      cls[j] = map[key];
     }
+  }
   
+  for (j = 255; j >= 0; j--) { reps[cls[j]] = j; }
+  return num;
+}
+
+/*
+** Takes the NFA and builds the DFA as far as it can
+** go within the limits. If that is everything the
+** NFA and the rest needed to build more is dropped.
+*/
+static mpc_dfa_t *mpc_dfa_new(mpc_nfa_t *a, int start) {
+  
+  int q, c;
+  size_t n;
+  mpc_dfa_cache_t *t;
+  mpc_dfa_t *d = calloc(1, sizeof(mpc_dfa_t));
+  
+  d->refs = 1;
+  MPC_MUTEX_INIT(d->lock);
+  
+  d->nfa = *a;
+  d->classes = mpc_nfa_classes(a, d->cls, d->reps);
+  d->size = (a->num + 7) / 8;
+  
+  /* Each state has a row, the set it stands for and two slots in the table */
+  n = mpc_re_budget / (d->classes * (sizeof(int) + 1) + 1 + d->size + 2 * sizeof(int));
+  d->max = n < 4 ? 4 : (n > 1 << 24 ? 1 << 24 : (int)n);
+  
+  t = mpc_dfa_cache_new(d);
+  d->caches = t;
+  
+  d->start = calloc(1, d->size);
+  MPC_BITS_ADD(d->start, start);
+  mpc_nfa_close(a, d->start, MPC_NFA_NONE, t->stack);
+  mpc_dfa_flush(d, t);
+  
+  for (q = 0; q < t->states; q++) {
+    for (c = 0; c < d->classes; c++) {
+      if (t->states > MPC_DFA_MAX || mpc_dfa_expand(d, t, q, c) < 0) {
+        d->lazy = 1;
+        d->idle = t;
+        d->states = t->states;
+        return d;
+      }
+    }
   }
   
-  out = comp ? mpc_noneof(range) : mpc_oneof(range);
+  d->states = t->states;
+  mpc_dfa_cache_done(t);
+  free(d->nfa.states); d->nfa.states = NULL;
+  free(d->start);      d->start = NULL;
   
-  free(x);
-  free(range);
+  return d;
+}
+
+/* Wraps the combinators `x` built for a regex with an automaton if they can be compiled to one */
+static mpc_parser_t *mpc_re_dfa(mpc_parser_t *x) {
   
-  return out;
+  int start;
+  mpc_nfa_t a;
+  mpc_parser_t *p;
+  unsigned char follow[32];
+  
+  /* Single characters and the like have nothing to gain */
+  switch (x->type) {
+    case MPC_TYPE_AND:
+    case MPC_TYPE_OR:
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_COUNT:
+      break;
+    default: return x;
+  }
+  
+  memset(follow, 0, 32);
+  if (!mpc_re_check(x, follow)) { return x; }
+  
+  a.num = 0;
+  a.slots = 0;
+  a.states = NULL;
+  
+  start = mpc_nfa_build(&a, x, mpc_nfa_add(&a, MPC_NFA_MATCH, -1, -1));
+  if (start < 0) {
+    free(a.states);
+    return x;
+  }
+  
+  p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.x = x;
+  p->data.dfa.d = mpc_dfa_new(&a, start);
+  return p;
 }
 
-mpc_parser_t *mpc_re(const char *re) {
+static mpc_parser_t *mpc_re_compile(const char *re) {
   
   char *err_msg;
   mpc_parser_t *err_out;
@@ -2019,7 +5586,7 @@ mpc_parser_t *mpc_re(const char *re) {
   mpc_define(Regex, mpc_and(2, 
     mpcf_re_or,
     Term, 
-    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_char('|'), Regex, free)),
+    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_char('|'), Regex, mpc_free)),
     (mpc_dtor_t)mpc_delete
   ));
   
@@ -2060,8 +5627,225 @@ mpc_parser_t *mpc_re(const char *re) {
   mpc_delete(RegexEnclose);
   mpc_cleanup(5, Regex, Term, Factor, Base, Range);
   
-  return r.output;
+  return mpc_re_dfa(r.output);
+  
+}
+
+/*
+** Regex Cache
+**
+** Building a regex bootstraps a whole grammar just
+** to read it, so each pattern is only compiled once
+** per process. The cache keeps one original of the
+** parser for each pattern and `mpc_re` hands out
+** copies of it, as the grammars using a regex own
+** and may rewrite it. Copying is a handful of small
+** allocations, and any DFA is not copied at all but
+** shared by counting references.
+**
+** The cache is locked, so grammars may be built on
+** many threads at once. The originals are never
+** changed after going in. Patterns past the limit
+** are simply not cached, and `mpc_re_cache_clear`
+** lets everything go.
+*/
+
+enum {
+  MPC_RE_CACHE_BUCKETS = 256,
+  MPC_RE_CACHE_MAX     = 4096
+};
+
+typedef struct mpc_re_entry_t {
+  struct mpc_re_entry_t *next;
+  char *re;
+  mpc_parser_t *p;
+} mpc_re_entry_t;
+
+MPC_MUTEX(mpc_re_lock);
+
+static mpc_re_entry_t *mpc_re_cache[MPC_RE_CACHE_BUCKETS];
+static int mpc_re_cache_num = 0;
+
+static mpc_re_entry_t **mpc_re_cache_bucket(const char *re) {
+  unsigned long h = 5381;
+  while (*re) { h = h * 33 + (unsigned char)*re++; }
+  return &mpc_re_cache[h % MPC_RE_CACHE_BUCKETS];
+}
+
+static mpc_re_entry_t *mpc_re_cache_find(const char *re) {
+  mpc_re_entry_t *e;
+  for (e = *mpc_re_cache_bucket(re); e; e = e->next) {
+    if (strcmp(e->re, re) == 0) { return e; }
+  }
+  return NULL;
+}
+
+static char *mpc_re_copy_str(const char *s) {
+  char *t = malloc(strlen(s) + 1);
+  strcpy(t, s);
+  return t;
+}
+
+/* Copies a parser built by `mpc_re`, which is always a tree of unretained parsers */
+static mpc_parser_t *mpc_re_copy(mpc_parser_t *p) {
+  
+  int i;
+  mpc_parser_t *q = malloc(sizeof(mpc_parser_t));
+  
+  *q = *p;
+#ifdef MPC_PROFILE
+  mpc_profile_reset(q);
+#endif
+  
+  if (q->name) { q->name = mpc_re_copy_str(q->name); }
+  
+  switch (q->type) {
+    
+    case MPC_TYPE_FAIL: q->data.fail.m = mpc_re_copy_str(q->data.fail.m); break;
+    
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      q->data.string.x = mpc_re_copy_str(q->data.string.x);
+      break;
+    
+    case MPC_TYPE_EXPECT:
+      q->data.expect.m = mpc_re_copy_str(q->data.expect.m);
+      q->data.expect.x = mpc_re_copy(q->data.expect.x);
+      break;
+    
+    case MPC_TYPE_APPLY:    q->data.apply.x    = mpc_re_copy(q->data.apply.x);    break;
+    case MPC_TYPE_APPLY_TO: q->data.apply_to.x = mpc_re_copy(q->data.apply_to.x); break;
+    case MPC_TYPE_PREDICT:  q->data.predict.x  = mpc_re_copy(q->data.predict.x);  break;
+    case MPC_TYPE_MEMO:     q->data.memo.x     = mpc_re_copy(q->data.memo.x);     break;
+    
+    case MPC_TYPE_DFA:
+      q->data.dfa.x = mpc_re_copy(q->data.dfa.x);
+      q->data.dfa.d = mpc_dfa_retain(q->data.dfa.d);
+      break;
+    
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_NOT:
+      q->data.not.x = mpc_re_copy(q->data.not.x);
+      break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      q->data.repeat.x = mpc_re_copy(q->data.repeat.x);
+      break;
+    
+    case MPC_TYPE_OR:
+      q->data.or.xs = malloc(sizeof(mpc_parser_t*) * q->data.or.n);
+      q->data.or.first = NULL;
+      for (i = 0; i < q->data.or.n; i++) { q->data.or.xs[i] = mpc_re_copy(p->data.or.xs[i]); }
+      break;
+    
+    case MPC_TYPE_AND:
+      q->data.and.xs = malloc(sizeof(mpc_parser_t*) * q->data.and.n);
+      q->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (q->data.and.n-1));
+      for (i = 0; i < q->data.and.n; i++) { q->data.and.xs[i] = mpc_re_copy(p->data.and.xs[i]); }
+      for (i = 0; i < q->data.and.n-1; i++) { q->data.and.dxs[i] = p->data.and.dxs[i]; }
+      break;
+    
+    default: break;
+  }
+  
+  return q;
+}
+
+mpc_parser_t *mpc_re(const char *re) {
+  
+  mpc_re_entry_t *e;
+  mpc_parser_t *p, *x;
+  
+  MPC_LOCK(mpc_re_lock);
+  e = mpc_re_cache_find(re);
+  p = e ? mpc_re_copy(e->p) : NULL;
+  MPC_UNLOCK(mpc_re_lock);
+  
+  if (p) { return p; }
+  
+  /* Compiled unlocked, so another thread may have put the same pattern in meanwhile */
+  x = mpc_re_compile(re);
+  
+  MPC_LOCK(mpc_re_lock);
+  e = mpc_re_cache_find(re);
+  if (e == NULL && mpc_re_cache_num < MPC_RE_CACHE_MAX) {
+    e = malloc(sizeof(mpc_re_entry_t));
+    e->re = mpc_re_copy_str(re);
+    e->p = x;
+    e->next = *mpc_re_cache_bucket(re);
+    *mpc_re_cache_bucket(re) = e;
+    mpc_re_cache_num++;
+    x = NULL;
+  }
+  p = e ? mpc_re_copy(e->p) : x;
+  MPC_UNLOCK(mpc_re_lock);
+  
+  if (e && x) { mpc_delete(x); }
+  return p;
+  
+}
+
+void mpc_re_cache_warm(int n, ...) {
+  
+  int i;
+  va_list va;
+  
+  va_start(va, n);
+  for (i = 0; i < n; i++) {
+    mpc_delete(mpc_re(va_arg(va, const char*)));
+  }
+  va_end(va);
+  
+}
+
+void mpc_re_cache_clear(void) {
+  
+  int i;
+  mpc_re_entry_t *e, *next;
+  
+  MPC_LOCK(mpc_re_lock);
+  for (i = 0; i < MPC_RE_CACHE_BUCKETS; i++) {
+    for (e = mpc_re_cache[i]; e; e = next) {
+      next = e->next;
+      mpc_delete(e->p);
+      free(e->re);
+      free(e);
+    }
+    mpc_re_cache[i] = NULL;
+  }
+  mpc_re_cache_num = 0;
+  MPC_UNLOCK(mpc_re_lock);
+  
+}
+
+/* Fills in how the automaton for a cached pattern is doing, or returns zero if it has none */
+int mpc_re_stats(const char *re, mpc_re_stats_t *s) {
+  
+  mpc_re_entry_t *e;
+  mpc_dfa_t *d = NULL;
+  
+  MPC_LOCK(mpc_re_lock);
+  e = mpc_re_cache_find(re);
+  if (e && e->p->type == MPC_TYPE_DFA) { d = mpc_dfa_retain(e->p->data.dfa.d); }
+  MPC_UNLOCK(mpc_re_lock);
+  
+  if (d == NULL) { return 0; }
   
+  MPC_LOCK(d->lock);
+  s->lazy = d->lazy;
+  s->states = d->states;
+  s->states_max = d->lazy ? d->max : d->states;
+  s->hits = d->hits;
+  s->misses = d->misses;
+  s->flushes = d->flushes;
+  s->fallbacks = d->fallbacks;
+  MPC_UNLOCK(d->lock);
+  
+  mpc_dfa_release(d);
+  return 1;
 }
 
 /*
@@ -2071,34 +5855,34 @@ mpc_parser_t *mpc_re(const char *re) {
 void mpcf_dtor_null(mpc_val_t *x) { return; }
 
 mpc_val_t *mpcf_ctor_null(void) { return NULL; }
-mpc_val_t *mpcf_ctor_str(void) { return calloc(1, 1); }
-mpc_val_t *mpcf_free(mpc_val_t *x) { free(x); return NULL; }
+mpc_val_t *mpcf_ctor_str(void) { return mpc_calloc(1, 1); }
+mpc_val_t *mpcf_free(mpc_val_t *x) { mpc_free(x); return NULL; }
 
 mpc_val_t *mpcf_int(mpc_val_t *x) {
-  int *y = malloc(sizeof(int));
+  int *y = mpc_malloc(sizeof(int));
   *y = strtol(x, NULL, 10);
-  free(x);
+  mpc_free(x);
   return y;
 }
 
 mpc_val_t *mpcf_hex(mpc_val_t *x) {
-  int *y = malloc(sizeof(int));
+  int *y = mpc_malloc(sizeof(int));
   *y = strtol(x, NULL, 16);
-  free(x);
+  mpc_free(x);
   return y;
 }
 
 mpc_val_t *mpcf_oct(mpc_val_t *x) {
-  int *y = malloc(sizeof(int));
+  int *y = mpc_malloc(sizeof(int));
   *y = strtol(x, NULL, 8);
-  free(x);
+  mpc_free(x);
   return y;
 }
 
 mpc_val_t *mpcf_float(mpc_val_t *x) {
-  float* y = malloc(sizeof(float));
+  float* y = mpc_malloc(sizeof(float));
   *y = strtod(x, NULL);
-  free(x);
+  mpc_free(x);
   return y;
 }
 
@@ -2124,7 +5908,7 @@ static mpc_val_t *mpcf_escape_new(mpc_val_t *x, char *input, char **output) {
   int i;
   int found;
   char *s = x;
-  char *y = calloc(1, 1);
+  char *y = mpc_calloc(1, 1);
   char buff[2];
   
   while (*s) {
@@ -2134,7 +5918,7 @@ static mpc_val_t *mpcf_escape_new(mpc_val_t *x, char *input, char **output) {
 
     while (output[i]) {
       if (*s == input[i]) {
-        y = realloc(y, strlen(y) + strlen(output[i]) + 1);
+        y = mpc_realloc(y, strlen(y) + strlen(output[i]) + 1);
         strcat(y, output[i]);
         found = 1;
         break;
@@ -2143,7 +5927,7 @@ static mpc_val_t *mpcf_escape_new(mpc_val_t *x, char *input, char **output) {
     }
     
     if (!found) {
-      y = realloc(y, strlen(y) + 2);
+      y = mpc_realloc(y, strlen(y) + 2);
       buff[0] = *s; buff[1] = '\0';
       strcat(y, buff);
     }
@@ -2160,7 +5944,7 @@ static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, char *input, char **output) {
   int i;
   int found = 0;
   char *s = x;
-  char *y = calloc(1, 1);
+  char *y = mpc_calloc(1, 1);
   char buff[2];
 
   while (*s) {
@@ -2171,7 +5955,7 @@ static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, char *input, char **output) {
     while (output[i]) {
       if ((*(s+0)) == output[i][0] &&
           (*(s+1)) == output[i][1]) {
-        y = realloc(y, strlen(y) + 2);
+        y = mpc_realloc(y, strlen(y) + 2);
         buff[0] = input[i]; buff[1] = '\0';
         strcat(y, buff);
         found = 1;
@@ -2182,7 +5966,7 @@ static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, char *input, char **output) {
     }
       
     if (!found) {
-      y = realloc(y, strlen(y) + 2);
+      y = mpc_realloc(y, strlen(y) + 2);
       buff[0] = *s; buff[1] = '\0';
       strcat(y, buff);
     }
@@ -2197,43 +5981,43 @@ static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, char *input, char **output) {
 
 mpc_val_t *mpcf_escape(mpc_val_t *x) {
   mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_c, mpc_escape_output_c);
-  free(x);
+  mpc_free(x);
   return y;
 }
 
 mpc_val_t *mpcf_unescape(mpc_val_t *x) {
   mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_c, mpc_escape_output_c);
-  free(x);
+  mpc_free(x);
   return y;
 }
 
 mpc_val_t *mpcf_unescape_regex(mpc_val_t *x) {
   mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
-  free(x);
+  mpc_free(x);
   return y;  
 }
 
 mpc_val_t *mpcf_escape_string_raw(mpc_val_t *x) {
   mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
-  free(x);
+  mpc_free(x);
   return y;
 }
 
 mpc_val_t *mpcf_unescape_string_raw(mpc_val_t *x) {
   mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
-  free(x);
+  mpc_free(x);
   return y;
 }
 
 mpc_val_t *mpcf_escape_char_raw(mpc_val_t *x) {
   mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
-  free(x);
+  mpc_free(x);
   return y;
 }
 
 mpc_val_t *mpcf_unescape_char_raw(mpc_val_t *x) {
   mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
-  free(x);
+  mpc_free(x);
   return y;
 }
 
@@ -2245,7 +6029,7 @@ mpc_val_t *mpcf_trd(int n, mpc_val_t **xs) { return xs[2]; }
 static mpc_val_t *mpcf_nth_free(int n, mpc_val_t **xs, int x) {
   int i;
   for (i = 0; i < n; i++) {
-    if (i != x) { free(xs[i]); }
+    if (i != x) { mpc_free(xs[i]); }
   }
   return xs[x];
 }
@@ -2255,12 +6039,12 @@ mpc_val_t *mpcf_snd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 1)
 mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2); }
 
 mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
-  char *x = calloc(1, 1);
+  char *x = mpc_calloc(1, 1);
   int i;
   for (i = 0; i < n; i++) {
-    x = realloc(x, strlen(x) + strlen(xs[i]) + 1);
+    x = mpc_realloc(x, strlen(x) + strlen(xs[i]) + 1);
     strcat(x, xs[i]);
-    free(xs[i]);
+    mpc_free(xs[i]);
   }
   return x;
 }
@@ -2275,7 +6059,7 @@ mpc_val_t *mpcf_maths(int n, mpc_val_t **xs) {
   if (strcmp(xs[1], "+") == 0) { *vs[0] += *vs[2]; }
   if (strcmp(xs[1], "-") == 0) { *vs[0] -= *vs[2]; }
   
-  free(xs[1]); free(xs[2]);
+  mpc_free(xs[1]); mpc_free(xs[2]);
   
   return xs[0];
 }
@@ -2304,6 +6088,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_LIFT)   { printf("<#>"); }
   if (p->type == MPC_TYPE_STATE)  { printf("<S>"); }
   if (p->type == MPC_TYPE_ANCHOR) { printf("<@>"); }
+  if (p->type == MPC_TYPE_CUT)    { printf("<~>"); }
   if (p->type == MPC_TYPE_EXPECT) {
     printf("%s", p->data.expect.m);
     /*mpc_print_unretained(p->data.expect.x, 0);*/
@@ -2319,7 +6104,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
       mpc_escape_input_c,
       mpc_escape_output_c);
     printf("'%s'", s);
-    free(s);
+    mpc_free(s);
   }
   
   if (p->type == MPC_TYPE_RANGE) {
@@ -2334,8 +6119,8 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
       mpc_escape_input_c,
       mpc_escape_output_c);
     printf("[%s-%s]", s, e);
-    free(s);
-    free(e);
+    mpc_free(s);
+    mpc_free(e);
   }
   
   if (p->type == MPC_TYPE_ONEOF) {
@@ -2344,7 +6129,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
       mpc_escape_input_c,
       mpc_escape_output_c);
     printf("[%s]", s);
-    free(s);
+    mpc_free(s);
   }
   
   if (p->type == MPC_TYPE_NONEOF) {
@@ -2353,7 +6138,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
       mpc_escape_input_c,
       mpc_escape_output_c);
     printf("[^%s]", s);
-    free(s);
+    mpc_free(s);
   }
   
   if (p->type == MPC_TYPE_STRING) {
@@ -2362,12 +6147,15 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
       mpc_escape_input_c,
       mpc_escape_output_c);
     printf("\"%s\"", s);
-    free(s);
+    mpc_free(s);
   }
   
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_print_unretained(p->data.memo.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { mpc_print_unretained(p->data.dfa.x, 0); }
+  if (p->type == MPC_TYPE_CODE)     { mpc_print_unretained(p->data.code.code, 1); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -2403,6 +6191,81 @@ void mpc_print(mpc_parser_t *p) {
   printf("\n");
 }
 
+/*
+** The profile report lists every parser reachable
+** from `p` which was entered at least once, with
+** the most expensive first.
+**
+** Counters live in the parsers themselves so only
+** profile a grammar while one thread is using it.
+*/
+
+#ifdef MPC_PROFILE
+
+static int mpc_profile_cmp(const void *a, const void *b) {
+  const mpc_parser_t *x = *(mpc_parser_t* const*)a;
+  const mpc_parser_t *y = *(mpc_parser_t* const*)b;
+  if (x->profile.time > y->profile.time) { return -1; }
+  if (x->profile.time < y->profile.time) { return  1; }
+  if (x->profile.calls > y->profile.calls) { return -1; }
+  if (x->profile.calls < y->profile.calls) { return  1; }
+  return 0;
+}
+
+void mpc_profile_print(mpc_parser_t *p) {
+  
+  int k;
+  mpc_compile_t c;
+  mpc_parser_t *q;
+  
+  mpc_compile_init(&c, NULL, 0);
+  mpc_compile_visit(&c, p);
+  qsort(c.nodes, c.nodes_num, sizeof(mpc_parser_t*), mpc_profile_cmp);
+  
+  printf("%10s %10s %10s %10s %10s  %s\n",
+    "calls", "pass", "fail", "backtrack", "time(ms)", "parser");
+  
+  for (k = 0; k < c.nodes_num; k++) {
+    q = c.nodes[k];
+    if (q->profile.calls == 0) { continue; }
+    printf("%10lu %10lu %10lu %10lu %10.3f  ",
+      q->profile.calls, q->profile.passes, q->profile.fails,
+      q->profile.backtracked, q->profile.time * 1000.0);
+    if (q->name) { printf("<%s>", q->name); }
+    else { mpc_print_unretained(q, 1); }
+    printf("\n");
+  }
+  
+  free(c.nodes);
+  free(c.table);
+}
+
+void mpc_profile_clear(mpc_parser_t *p) {
+  
+  int k;
+  mpc_compile_t c;
+  
+  mpc_compile_init(&c, NULL, 0);
+  mpc_compile_visit(&c, p);
+  for (k = 0; k < c.nodes_num; k++) { mpc_profile_reset(c.nodes[k]); }
+  
+  free(c.nodes);
+  free(c.table);
+}
+
+#else
+
+void mpc_profile_print(mpc_parser_t *p) {
+  (void)p;
+  printf("mpc: no profile, build with MPC_PROFILE defined\n");
+}
+
+void mpc_profile_clear(mpc_parser_t *p) {
+  (void)p;
+}
+
+#endif
+
 /*
 ** Testing
 */
@@ -2478,39 +6341,95 @@ void mpc_ast_delete(mpc_ast_t *a) {
   int i;
   
   if (a == NULL) { return; }
+  if (a->refs > 0) { a->refs--; return; }
   for (i = 0; i < a->children_num; i++) {
     mpc_ast_delete(a->children[i]);
   }
   
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
+  mpc_free(a->children);
+  mpc_free(a->tag);
+  mpc_free(a->contents);
+  mpc_free(a);
   
 }
 
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
+  mpc_free(a->children);
+  mpc_free(a->tag);
+  mpc_free(a->contents);
+  mpc_free(a);
+}
+
+mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+  
+  mpc_ast_t *a = mpc_malloc(sizeof(mpc_ast_t));
+  
+  a->tag = mpc_malloc(strlen(tag) + 1);
+  strcpy(a->tag, tag);
+  
+  a->contents = mpc_malloc(strlen(contents) + 1);
+  strcpy(a->contents, contents);
+  
+  a->state = mpc_state_new();
+  
+  a->children_num = 0;
+  a->children = NULL;
+  a->refs = 0;
+  return a;
+  
+}
+
+/*
+** A retained node is shared, and must be deleted
+** once more for each time it was retained. The
+** functions below which change a node leave a
+** shared one alone, changing and returning a
+** copy of it instead. The copy shares children.
+*/
+
+mpc_ast_t *mpc_ast_retain(mpc_ast_t *a) {
+  if (a) { a->refs++; }
+  return a;
+}
+
+static mpc_ast_t *mpc_ast_own(mpc_ast_t *a) {
+  
+  int i;
+  mpc_ast_t *b;
+  
+  if (a->refs == 0) { return a; }
+  
+  b = mpc_ast_new(a->tag, a->contents);
+  b->state = a->state;
+  b->children_num = a->children_num;
+  
+  if (a->children_num) {
+    b->children = mpc_malloc(sizeof(mpc_ast_t*) * a->children_num);
+    for (i = 0; i < a->children_num; i++) {
+      b->children[i] = mpc_ast_retain(a->children[i]);
+    }
+  }
+  
+  a->refs--;
+  return b;
 }
 
-mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
-  
-  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
   
-  a->tag = malloc(strlen(tag) + 1);
-  strcpy(a->tag, tag);
+  int i;
+  mpc_ast_t *b = mpc_ast_new(a->tag, a->contents);
   
-  a->contents = malloc(strlen(contents) + 1);
-  strcpy(a->contents, contents);
+  b->state = a->state;
+  b->children_num = a->children_num;
   
-  a->state = mpc_state_new();
+  if (a->children_num) {
+    b->children = mpc_malloc(sizeof(mpc_ast_t*) * a->children_num);
+    for (i = 0; i < a->children_num; i++) {
+      b->children[i] = mpc_ast_copy(a->children[i]);
+    }
+  }
   
-  a->children_num = 0;
-  a->children = NULL;
-  return a;
+  return b;
   
 }
 
@@ -2561,15 +6480,17 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 }
 
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+  r = mpc_ast_own(r);
   r->children_num++;
-  r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
+  r->children = mpc_realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
   r->children[r->children_num-1] = a;
   return r;
 }
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
+  a = mpc_ast_own(a);
+  a->tag = mpc_realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
   memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, strlen(t));
   memmove(a->tag + strlen(t), "|", 1);
@@ -2577,13 +6498,16 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
-  a->tag = realloc(a->tag, strlen(t) + 1);
+  if (a == NULL) { return a; }
+  a = mpc_ast_own(a);
+  a->tag = mpc_realloc(a->tag, strlen(t) + 1);
   strcpy(a->tag, t);
   return a;
 }
 
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
   if (a == NULL) { return a; }
+  a = mpc_ast_own(a);
   a->state = s;
   return a;
 }
@@ -2629,10 +6553,10 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
     if (as[i] && as[i]->children_num > 0) {
       
       for (j = 0; j < as[i]->children_num; j++) {
-        mpc_ast_add_child(r, as[i]->children[j]);
+        mpc_ast_add_child(r, as[i]->refs ? mpc_ast_retain(as[i]->children[j]) : as[i]->children[j]);
       }
       
-      mpc_ast_delete_no_children(as[i]);
+      if (as[i]->refs) { mpc_ast_delete(as[i]); } else { mpc_ast_delete_no_children(as[i]); }
       
     } else if (as[i] && as[i]->children_num == 0) {
       mpc_ast_add_child(r, as[i]);
@@ -2649,7 +6573,7 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
 
 mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
   mpc_ast_t *a = mpc_ast_new("", c);
-  free(c);
+  mpc_free(c);
   return a;
 }
 
@@ -2657,16 +6581,18 @@ mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs) {
   mpc_state_t *s = ((mpc_state_t**)xs)[0];
   mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
   a = mpc_ast_state(a, *s);
-  free(s);
+  mpc_free(s);
   return a;
 }
 
 mpc_parser_t *mpca_state(mpc_parser_t *a) {
-  return mpc_and(2, mpcf_state_ast, mpc_state(), a, free);
+  return mpc_and(2, mpcf_state_ast, mpc_state(), a, mpc_free);
 }
 
 mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag, (void*)t);
+  mpc_parser_t *p = mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag, (void*)t);
+  p->mark = MPC_MARK_TAG;
+  return p;
 }
 
 mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
@@ -2679,9 +6605,14 @@ mpc_parser_t *mpca_root(mpc_parser_t *a) {
 
 mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpc_not(a, (mpc_dtor_t)mpc_ast_delete); }
 mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
-mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
-mpc_parser_t *mpca_many1(mpc_parser_t *a) { return mpc_many1(mpcf_fold_ast, a); }
-mpc_parser_t *mpca_count(int n, mpc_parser_t *a) { return mpc_count(n, mpcf_fold_ast, a, (mpc_dtor_t)mpc_ast_delete); }
+static mpc_parser_t *mpca_tree(mpc_parser_t *p) {
+  p->mark = MPC_MARK_TREE;
+  return p;
+}
+
+mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpca_tree(mpc_many(mpcf_fold_ast, a)); }
+mpc_parser_t *mpca_many1(mpc_parser_t *a) { return mpca_tree(mpc_many1(mpcf_fold_ast, a)); }
+mpc_parser_t *mpca_count(int n, mpc_parser_t *a) { return mpca_tree(mpc_count(n, mpcf_fold_ast, a, (mpc_dtor_t)mpc_ast_delete)); }
 
 mpc_parser_t *mpca_or(int n, ...) {
 
@@ -2693,6 +6624,7 @@ mpc_parser_t *mpca_or(int n, ...) {
   p->type = MPC_TYPE_OR;
   p->data.or.n = n;
   p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.first = NULL;
   
   va_start(va, n);  
   for (i = 0; i < n; i++) {
@@ -2712,6 +6644,7 @@ mpc_parser_t *mpca_and(int n, ...) {
   mpc_parser_t *p = mpc_undefined();
   
   p->type = MPC_TYPE_AND;
+  p->mark = MPC_MARK_TREE;
   p->data.and.n = n;
   p->data.and.f = mpcf_fold_ast;
   p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
@@ -2731,6 +6664,617 @@ mpc_parser_t *mpca_and(int n, ...) {
 
 mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
 
+/*
+** Incremental Reparsing
+**
+** After an edit most of a tree is still right.
+** The innermost node holding every edit whose
+** tag begins with the name of a rule, such as
+** `sexpr|>` or `expr|number|regex`, is parsed
+** again with just that rule, and the tag put
+** back on. Every other node is kept, with those
+** after the edit moved along.
+**
+** A node's text runs from its own start to the
+** start of whatever follows it. The new parse
+** only stands if it ends exactly where that
+** text now ends and has the same shape, a leaf
+** or not, otherwise the parent is tried next.
+** At the root the whole input is parsed again.
+**
+** When the edits begin right at a node's start
+** the token before it may now run on, as `12`
+** does before `x` becomes `5` in `(+ 12x)`. So
+** the deepest rule ending there is parsed again
+** too and must still end in the same place, or
+** the parent is tried next.
+**
+** This relies on which rule matches at a place
+** being decided by that rule and the text it
+** covers, as it is in grammars such as Lispy.
+** Lookahead from further away into the edit is
+** not noticed.
+**
+** Positions in a tree are absolute, so moving
+** the nodes after an edit is the one part that
+** grows with the file. It is a single pass over
+** them, and is skipped when nothing moves.
+*/
+
+static mpc_parser_t *mpca_reparse_rule(mpc_compile_t *c, const char *tag) {
+  
+  int k, n;
+  const char *bar = strchr(tag, '|');
+  
+  if (bar == NULL) { return NULL; }
+  n = bar - tag;
+  
+  for (k = 0; k < c->nodes_num; k++) {
+    if (c->nodes[k]->name
+    && strncmp(c->nodes[k]->name, tag, n) == 0
+    && c->nodes[k]->name[n] == '\0') { return c->nodes[k]; }
+  }
+  
+  return NULL;
+}
+
+static mpc_ast_t *mpca_reparse_node(const char *filename, const char *string, int length,
+  mpc_ast_t *a, int end, mpc_parser_t *rule) {
+  
+  mpc_stack_t stk;
+  mpc_result_t r;
+  mpc_ast_t *b = NULL;
+  mpc_input_t *i = mpc_input_new_string(filename, string, length);
+  
+  mpc_input_window(i, a->state.pos, length, a->state.row, a->state.row > 0 ? a->state.pos - a->state.col - 1 : -1);
+  i->last = a->state.pos > 0 ? string[a->state.pos-1] : '\0';
+  
+  /* Quietly, as a failure just means trying the parent */
+  mpc_stack_init(&stk);
+  mpc_stack_begin(&stk, i, 1);
+  mpc_stack_pushp(&stk, rule);
+  mpc_parse_run(i, &stk);
+  if (mpc_stack_terminate(&stk, &r)) { b = r.output; } else { mpc_err_delete(r.error); }
+  mpc_stack_trim(&stk);
+  
+  if (b && (i->state.pos != end || b->children_num == 1
+  || (a->children_num == 0) != (b->children_num == 0))) {
+    mpc_ast_delete(b);
+    b = NULL;
+  }
+  
+  mpc_input_delete(i);
+  
+  if (b) {
+    mpc_ast_add_tag(b, rule->name);
+    b->state = a->state;
+  }
+  
+  return b;
+}
+
+static int mpca_reparse_before(mpc_compile_t *c, const char *filename, const char *string, int length,
+  mpc_ast_t **path, int *ks, int d, int lo) {
+  
+  int l;
+  mpc_ast_t *x = NULL, *y = NULL, *b;
+  mpc_parser_t *rule, *yrule = NULL;
+  
+  if (lo > path[d]->state.pos) { return 1; }
+  
+  for (l = d-1; l >= 0 && x == NULL; l--) {
+    if (ks[l] > 0) { x = path[l]->children[ks[l]-1]; }
+  }
+  
+  if (x == NULL) { return 1; }
+  
+  /* Down the last children to the deepest rule */
+  while (1) {
+    rule = mpca_reparse_rule(c, x->tag);
+    if (rule) { y = x; yrule = rule; }
+    if (x->children_num == 0) { break; }
+    x = x->children[x->children_num-1];
+  }
+  
+  if (y == NULL) { return 0; }
+  
+  b = mpca_reparse_node(filename, string, length, y, path[d]->state.pos, yrule);
+  if (b == NULL) { return 0; }
+  
+  mpc_ast_delete(b);
+  return 1;
+}
+
+static void mpca_reparse_shift(mpc_ast_t *a, int delta, int row, int drow, int dcol) {
+  int k;
+  if (a->state.row == row) { a->state.col += dcol; }
+  a->state.pos += delta;
+  a->state.row += drow;
+  for (k = 0; k < a->children_num; k++) {
+    mpca_reparse_shift(a->children[k], delta, row, drow, dcol);
+  }
+}
+
+/*
+** Moves everything after the new node at depth
+** `d`, working out the new row and column of the
+** first such node by counting the lines between
+** it and the start of the new node.
+*/
+
+static void mpca_reparse_move(const char *string, mpc_ast_t **path, int *ks, int d, int delta) {
+  
+  int k, l, to, lines = 0, last = -1, drow = 0, dcol = 0, row = -1;
+  mpc_ast_t *a = path[d], *x = NULL;
+  
+  for (l = d-1; l >= 0 && x == NULL; l--) {
+    if (ks[l]+1 < path[l]->children_num) { x = path[l]->children[ks[l]+1]; }
+  }
+  
+  if (x == NULL) { return; }
+  
+  to = x->state.pos + delta;
+  for (k = a->state.pos; k < to; k++) {
+    if (string[k] == '\n') { lines++; last = k; }
+  }
+  
+  row = x->state.row;
+  drow = a->state.row + lines - x->state.row;
+  dcol = (lines ? to - (last + 1) : a->state.col + (to - a->state.pos)) - x->state.col;
+  
+  if (delta == 0 && drow == 0 && dcol == 0) { return; }
+  
+  for (l = d-1; l >= 0; l--) {
+    for (k = ks[l]+1; k < path[l]->children_num; k++) {
+      mpca_reparse_shift(path[l]->children[k], delta, row, drow, dcol);
+    }
+  }
+}
+
+int mpca_reparse(const char *filename, const char *string, mpc_ast_t *a,
+  const mpc_edit_t *es, int n, mpc_parser_t *p, mpc_result_t *r) {
+  
+  int k, d, lo, hi, lo_k, hi_k, end, next, delta = 0, depth = 0, slots = 16;
+  int length = strlen(string);
+  mpc_ast_t **path, *b, *x;
+  mpc_parser_t *rule;
+  mpc_compile_t c;
+  int *ks, *ends;
+  
+  if (a == NULL) { return mpc_parse(filename, string, p, r); }
+  if (n == 0) { r->output = a; return 1; }
+  
+  lo = es[0].pos;
+  hi = es[0].pos + es[0].removed;
+  for (k = 0; k < n; k++) {
+    if (es[k].pos < lo) { lo = es[k].pos; }
+    if (es[k].pos + es[k].removed > hi) { hi = es[k].pos + es[k].removed; }
+    delta += es[k].added - es[k].removed;
+  }
+  
+  path = malloc(sizeof(mpc_ast_t*) * slots);
+  ks = malloc(sizeof(int) * slots);
+  ends = malloc(sizeof(int) * slots);
+  
+  /* Down to the innermost node holding every edit */
+  
+  x = a;
+  end = length - delta;
+  
+  while (1) {
+    
+    if (depth == slots) {
+      slots *= 2;
+      path = realloc(path, sizeof(mpc_ast_t*) * slots);
+      ks = realloc(ks, sizeof(int) * slots);
+      ends = realloc(ends, sizeof(int) * slots);
+    }
+    
+    path[depth] = x;
+    ends[depth] = end;
+    ks[depth] = -1;
+    depth++;
+    
+    /* The last child starting at or before the edits */
+    lo_k = 0;
+    hi_k = x->children_num;
+    while (lo_k < hi_k) {
+      k = (lo_k + hi_k) / 2;
+      if (x->children[k]->state.pos <= lo) { lo_k = k + 1; } else { hi_k = k; }
+    }
+    
+    k = lo_k - 1;
+    if (k < 0) { break; }
+    next = k+1 < x->children_num ? x->children[k+1]->state.pos : end;
+    if (hi > next) { break; }
+    
+    ks[depth-1] = k;
+    x = x->children[k];
+    end = next;
+  }
+  
+  /* Back up to the first rule that parses again in place */
+  
+  mpc_compile_init(&c, NULL, 0);
+  mpc_compile_visit(&c, p);
+  
+  b = NULL;
+  for (d = depth-1; d > 0 && b == NULL; d--) {
+    rule = mpca_reparse_rule(&c, path[d]->tag);
+    if (rule == NULL) { continue; }
+    if (!mpca_reparse_before(&c, filename, string, length, path, ks, d, lo)) { continue; }
+    b = mpca_reparse_node(filename, string, length, path[d], ends[d] + delta, rule);
+  }
+  
+  free(c.nodes);
+  free(c.table);
+  
+  if (b) {
+    d++;
+    mpca_reparse_move(string, path, ks, d, delta);
+    path[d-1]->children[ks[d-1]] = b;
+    mpc_ast_delete(path[d]);
+    r->output = a;
+    k = 1;
+  } else {
+    k = mpc_parse(filename, string, p, r);
+    if (k) { mpc_ast_delete(a); }
+  }
+  
+  free(path);
+  free(ks);
+  free(ends);
+  
+  return k;
+}
+
+/*
+** Optimiser
+**
+** Grammars from `mpca_lang` and `mpc_re` come
+** out as long chains of binary `and` and `or`
+** with a wrapper or two around every piece, and
+** the parse pays for each of those nodes. The
+** optimiser rewrites the unretained part of a
+** graph in place. Chains are flattened into one
+** n-ary node, runs of characters in a regex are
+** joined into a string, neighbouring classes in
+** an `or` become one class and wrappers which do
+** nothing are dropped.
+**
+** Outputs are unchanged. Errors can come out a
+** little differently where characters or classes
+** have been merged, as the merged parser expects
+** the whole string or class at once.
+*/
+
+/*
+** A chain of binary `mpcf_fold_ast` folds keeps
+** a lone result as it is, while a single n-ary
+** fold would wrap it. This fold behaves like the
+** chain so that flattening it changes nothing.
+*/
+static mpc_val_t *mpcf_fold_ast_seq(int n, mpc_val_t **xs) {
+  int i, j = 0, k = 0;
+  for (i = 0; i < n; i++) {
+    if (xs[i] != NULL) { j = i; k++; }
+  }
+  if (k == 0) { return NULL; }
+  if (k == 1) { return xs[j]; }
+  return mpcf_fold_ast(n, xs);
+}
+
+static int mpc_optimise_seq(mpc_parser_t *p) {
+  return p->type == MPC_TYPE_AND
+    && (p->data.and.f == mpcf_fold_ast_seq
+    || (p->data.and.f == mpcf_fold_ast && p->data.and.n <= 2));
+}
+
+static int mpc_optimise_str(mpc_parser_t *p) {
+  return p->type == MPC_TYPE_AND && p->data.and.f == mpcf_strfold;
+}
+
+/* Parsers whose output is dropped by the fold they are in */
+static int mpc_optimise_empty(mpc_parser_t *p, mpc_parser_t *x) {
+  if (x->retained) { return 0; }
+  if (mpc_optimise_seq(p)) { return x->type == MPC_TYPE_PASS; }
+  return x->type == MPC_TYPE_LIFT && x->data.lift.lf == mpcf_ctor_str;
+}
+
+/* Returns the length of a literal character or string */
+static int mpc_optimise_lit(mpc_parser_t *x, const char **s) {
+  if (x->retained || x->type != MPC_TYPE_EXPECT) { return 0; }
+  x = x->data.expect.x;
+  if (x->retained) { return 0; }
+  if (x->type == MPC_TYPE_SINGLE && x->data.single.x != '\0') {
+    *s = &x->data.single.x;
+    return 1;
+  }
+  if (x->type == MPC_TYPE_STRING) {
+    *s = x->data.string.x;
+    return x->data.string.n;
+  }
+  return 0;
+}
+
+/* Adds a character class to `m`, returning 0 if `x` is not one */
+static int mpc_optimise_class(mpc_parser_t *x, unsigned char *m) {
+  
+  int c;
+  
+  if (x->retained || x->type != MPC_TYPE_EXPECT) { return 0; }
+  x = x->data.expect.x;
+  if (x->retained) { return 0; }
+  
+  switch (x->type) {
+    case MPC_TYPE_SINGLE:
+      if (x->data.single.x == '\0') { return 0; }
+      if (m) { MPC_CLASS_ADD(m, x->data.single.x); }
+      return 1;
+    case MPC_TYPE_RANGE:
+      if (x->data.range.x > x->data.range.y) { return 0; }
+      if (x->data.range.x <= '\0' && x->data.range.y >= '\0') { return 0; }
+      for (c = 0; m && c < 256; c++) {
+        if ((char)c >= x->data.range.x && (char)c <= x->data.range.y) { MPC_CLASS_ADD(m, c); }
+      }
+      return 1;
+    case MPC_TYPE_ONEOF:
+      if (x->data.string.n == 0) { return 0; }
+      for (c = 0; m && c < 32; c++) { m[c] |= x->data.string.m[c]; }
+      return 1;
+    default:
+      return 0;
+  }
+  
+}
+
+/* Replaces `p` by its child `x`, whose node is freed */
+static void mpc_optimise_become(mpc_parser_t *p, mpc_parser_t *x) {
+  p->type = x->type;
+  p->mark = (p->mark & MPC_MARK_RULE) | x->mark;
+  p->data = x->data;
+  free(x->name);
+  free(x);
+}
+
+static void mpc_optimise_and(mpc_parser_t *p) {
+  
+  int i, j, k, l, c, n = 0;
+  int seq = mpc_optimise_seq(p);
+  int str = mpc_optimise_str(p);
+  mpc_parser_t *x, **xs;
+  mpc_dtor_t d, *dxs;
+  const char *s;
+  char *lit;
+  
+  if (!seq && !str) { return; }
+  
+  /* Flatten Children */
+  
+  for (i = 0; i < p->data.and.n; i++) {
+    x = p->data.and.xs[i];
+    n += (!x->retained && (seq ? mpc_optimise_seq(x) : mpc_optimise_str(x))) ? x->data.and.n : 1;
+  }
+  
+  xs = malloc(sizeof(mpc_parser_t*) * n);
+  dxs = malloc(sizeof(mpc_dtor_t) * n);
+  n = 0;
+  
+  for (i = 0; i < p->data.and.n; i++) {
+    x = p->data.and.xs[i];
+    d = i < p->data.and.n-1 ? p->data.and.dxs[i] : NULL;
+    if (!x->retained && (seq ? mpc_optimise_seq(x) : mpc_optimise_str(x))) {
+      for (j = 0; j < x->data.and.n; j++) {
+        xs[n] = x->data.and.xs[j];
+        dxs[n] = j < x->data.and.n-1 ? x->data.and.dxs[j] : d;
+        n++;
+      }
+      free(x->data.and.xs);
+      free(x->data.and.dxs);
+      free(x->name);
+      free(x);
+    } else {
+      xs[n] = x;
+      dxs[n] = d;
+      n++;
+    }
+  }
+  
+  free(p->data.and.xs);
+  free(p->data.and.dxs);
+  
+  /* Drop Empty Parsers */
+  
+  for (i = 0, k = 0; i < n; i++) {
+    if (k + (n - i) > 1 && mpc_optimise_empty(p, xs[i])) {
+      mpc_delete(xs[i]);
+    } else {
+      xs[k] = xs[i];
+      dxs[k] = dxs[i];
+      k++;
+    }
+  }
+  n = k;
+  
+  /* Join Literals */
+  
+  for (i = 0, k = 0; str && i < n; i = j) {
+    
+    for (j = i, l = 0; j < n && (c = mpc_optimise_lit(xs[j], &s)) > 0; j++) { l += c; }
+    
+    if (j - i < 2) {
+      j = i + 1;
+      xs[k] = xs[i];
+      dxs[k] = dxs[i];
+      k++;
+      continue;
+    }
+    
+    lit = malloc(l + 1);
+    for (l = 0; i < j; i++) {
+      c = mpc_optimise_lit(xs[i], &s);
+      memcpy(lit + l, s, c);
+      l += c;
+      mpc_delete(xs[i]);
+    }
+    lit[l] = '\0';
+    
+    xs[k] = mpc_string(lit);
+    dxs[k] = dxs[j-1];
+    k++;
+    free(lit);
+  }
+  if (str) { n = k; }
+  
+  if (n == 1 && !xs[0]->retained) {
+    x = xs[0];
+    free(xs);
+    free(dxs);
+    mpc_optimise_become(p, x);
+    return;
+  }
+  
+  p->data.and.n = n;
+  p->data.and.xs = xs;
+  p->data.and.dxs = dxs;
+  if (seq) { p->data.and.f = mpcf_fold_ast_seq; }
+  
+}
+
+static void mpc_optimise_or(mpc_parser_t *p) {
+  
+  int i, j, k, c, l, n = 0;
+  unsigned char m[32];
+  mpc_parser_t *x, **xs;
+  char *cls;
+  
+  /* Flatten Children */
+  
+  for (i = 0; i < p->data.or.n; i++) {
+    x = p->data.or.xs[i];
+    n += (!x->retained && x->type == MPC_TYPE_OR) ? x->data.or.n : 1;
+  }
+  
+  xs = malloc(sizeof(mpc_parser_t*) * n);
+  n = 0;
+  
+  for (i = 0; i < p->data.or.n; i++) {
+    x = p->data.or.xs[i];
+    if (!x->retained && x->type == MPC_TYPE_OR) {
+      for (j = 0; j < x->data.or.n; j++) { xs[n++] = x->data.or.xs[j]; }
+      free(x->data.or.xs);
+      free(x->data.or.first);
+      free(x->name);
+      free(x);
+    } else {
+      xs[n++] = x;
+    }
+  }
+  
+  free(p->data.or.xs);
+  
+  /* Merge Classes */
+  
+  for (i = 0, k = 0; i < n; i = j) {
+    
+    for (j = i; j < n && mpc_optimise_class(xs[j], NULL); j++);
+    
+    if (j - i < 2) {
+      j = i + 1;
+      xs[k++] = xs[i];
+      continue;
+    }
+    
+    memset(m, 0, 32);
+    for (c = i; c < j; c++) { mpc_optimise_class(xs[c], m); }
+    
+    cls = malloc(256);
+    for (c = 1, l = 0; c < 256; c++) {
+      if (MPC_CLASS_HAS(m, c)) { cls[l++] = c; }
+    }
+    cls[l] = '\0';
+    
+    for (c = i; c < j; c++) { mpc_delete(xs[c]); }
+    
+    /* Only classes from `mpc_oneof` match a null byte */
+    xs[k] = mpc_oneof(cls);
+    if (!(m[0] & 1)) { xs[k]->data.expect.x->data.string.m[0] &= ~1; }
+    k++;
+    free(cls);
+  }
+  n = k;
+  
+  free(p->data.or.first);
+  p->data.or.first = NULL;
+  
+  if (n == 1 && !xs[0]->retained) {
+    x = xs[0];
+    free(xs);
+    mpc_optimise_become(p, x);
+    return;
+  }
+  
+  p->data.or.n = n;
+  p->data.or.xs = xs;
+  
+}
+
+static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
+  
+  int i;
+  mpc_parser_t *x;
+  
+  if (p->retained && !force) { return; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_EXPECT:
+      mpc_optimise_unretained(p->data.expect.x, 0);
+      x = p->data.expect.x;
+      if (!x->retained && x->type == MPC_TYPE_EXPECT) {
+        p->data.expect.x = x->data.expect.x;
+        free(x->data.expect.m);
+        free(x->name);
+        free(x);
+      }
+      break;
+    
+    case MPC_TYPE_APPLY:    mpc_optimise_unretained(p->data.apply.x, 0);    break;
+    case MPC_TYPE_APPLY_TO: mpc_optimise_unretained(p->data.apply_to.x, 0); break;
+    case MPC_TYPE_PREDICT:  mpc_optimise_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_MEMO:     mpc_optimise_unretained(p->data.memo.x, 0);     break;
+    case MPC_TYPE_DFA:      mpc_optimise_unretained(p->data.dfa.x, 0);      break;
+    
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_NOT:
+      mpc_optimise_unretained(p->data.not.x, 0);
+      break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_optimise_unretained(p->data.repeat.x, 0);
+      break;
+    
+    case MPC_TYPE_OR:
+      for (i = 0; i < p->data.or.n; i++) { mpc_optimise_unretained(p->data.or.xs[i], 0); }
+      mpc_optimise_or(p);
+      break;
+    
+    case MPC_TYPE_AND:
+      for (i = 0; i < p->data.and.n; i++) { mpc_optimise_unretained(p->data.and.xs[i], 0); }
+      mpc_optimise_and(p);
+      break;
+    
+    default: break;
+  }
+  
+}
+
+void mpc_optimise(mpc_parser_t *p) {
+  mpc_optimise_unretained(p, 1);
+}
+
 /*
 ** Grammar Parser
 */
@@ -2772,6 +7316,7 @@ mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_
 **             | <string_lit>
 **             | <char_lit>
 **             | <regex_lit>
+**             | "~"
 **             | "(" <grammar> ")"
 */
 
@@ -2809,12 +7354,18 @@ static mpc_val_t *mpcaf_grammar_repeat(int n, mpc_val_t **xs) {
   return mpca_count(num, xs[0]);
 }
 
+static mpc_parser_t *mpca_grammar_token(mpc_parser_t *p, const char *t) {
+  p = mpc_apply(p, mpcf_str_ast);
+  p->mark = MPC_MARK_TOKEN;
+  return mpca_state(mpca_tag(p, t));
+}
+
 static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
   mpca_grammar_st_t *st = s;
   char *y = mpcf_unescape(x);
   mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
   free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "string"));
+  return mpca_grammar_token(p, "string");
 }
 
 static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
@@ -2822,7 +7373,7 @@ static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
   char *y = mpcf_unescape(x);
   mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
   free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "char"));
+  return mpca_grammar_token(p, "char");
 }
 
 static mpc_val_t *mpcaf_grammar_regex(mpc_val_t *x, void *s) {
@@ -2830,7 +7381,12 @@ static mpc_val_t *mpcaf_grammar_regex(mpc_val_t *x, void *s) {
   char *y = mpcf_unescape_regex(x);
   mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re(y) : mpc_tok(mpc_re(y));
   free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"));
+  return mpca_grammar_token(p, "regex");
+}
+
+static mpc_val_t *mpcaf_grammar_cut(mpc_val_t *x) {
+  free(x);
+  return mpc_cut();
 }
 
 static int is_number(const char* s) {
@@ -2895,6 +7451,7 @@ static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
   free(x);
 
   if (p->name) {
+    p->mark |= MPC_MARK_RULE;
     return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
   } else {
     return mpca_state(mpca_root(p));
@@ -2938,11 +7495,12 @@ mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
     mpc_soft_delete
   ));
   
-  mpc_define(Base, mpc_or(5,
+  mpc_define(Base, mpc_or(6,
     mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
     mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
     mpc_apply_to(mpc_tok(mpc_regex_lit()),  mpcaf_grammar_regex, st),
     mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
+    mpc_apply(mpc_sym("~"), mpcaf_grammar_cut),
     mpc_tok_parens(Grammar, mpc_soft_delete)
   ));
   
@@ -2956,6 +7514,8 @@ mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
   
   mpc_cleanup(5, GrammarTotal, Grammar, Term, Factor, Base);
   
+  if (!(st->flags & MPCA_LANG_NO_OPTIMISE)) { mpc_optimise(r.output); }
+  
   return (st->flags & MPCA_LANG_PREDICTIVE) ? mpc_predictive(r.output) : r.output;
   
 }
@@ -3030,14 +7590,23 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
   mpca_grammar_st_t *st = s;
   mpca_stmt_t *stmt;
   mpca_stmt_t **stmts = x;
-  mpc_parser_t *left;
+  mpc_parser_t *left, **lefts;
+  int n = 0;
+  
+  while (stmts[n]) { n++; }
+  lefts = malloc(sizeof(mpc_parser_t*) * (n ? n : 1));
+  n = 0;
 
   while(*stmts) {
     stmt = *stmts;
     left = mpca_grammar_find_parser(stmt->ident, st);
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+    if (st->flags & MPCA_LANG_PACKRAT) { stmt->grammar = mpc_memo(stmt->grammar, (mpc_copy_t)mpc_ast_retain, (mpc_dtor_t)mpc_ast_delete); }
     mpc_define(left, stmt->grammar);
+    left->mark |= MPC_MARK_RULE;
+    if (!(st->flags & MPCA_LANG_NO_OPTIMISE)) { mpc_optimise(left); }
+    lefts[n++] = left;
     free(stmt->ident);
     free(stmt->name);
     free(stmt);
@@ -3045,6 +7614,9 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
   }
   free(x);
   
+  mpc_first(NULL, lefts, n);
+  free(lefts);
+  
   return NULL;
 }
 
@@ -3091,11 +7663,12 @@ static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
     mpc_soft_delete
   ));
   
-  mpc_define(Base, mpc_or(5,
+  mpc_define(Base, mpc_or(6,
     mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
     mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
     mpc_apply_to(mpc_tok(mpc_regex_lit()),  mpcaf_grammar_regex, st),
     mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
+    mpc_apply(mpc_sym("~"), mpcaf_grammar_cut),
     mpc_tok_parens(Grammar, mpc_soft_delete)
   ));
   
@@ -3169,7 +7742,7 @@ mpc_err_t *mpca_lang(int flags, const char *language, ...) {
   st.parsers = NULL;
   st.flags = flags;
   
-  i = mpc_input_new_string("<mpca_lang>", language);
+  i = mpc_input_new_string("<mpca_lang>", language, strlen(language));
   err = mpca_lang_st(i, &st);
   mpc_input_delete(i);
   
@@ -60,21 +60,86 @@ struct mpc_parser_t;
 typedef struct mpc_parser_t mpc_parser_t;
 
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_n(const char *filename, const char *string, int length, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/* Cheaper on failure, but the error may name fewer alternatives */
+int mpc_parse_quiet(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+
+/*
+** Arenas
+*/
+
+struct mpc_arena_t;
+typedef struct mpc_arena_t mpc_arena_t;
+
+mpc_arena_t *mpc_arena_new(void);
+void mpc_arena_clear(mpc_arena_t *a);
+void mpc_arena_delete(mpc_arena_t *a);
+
+int mpc_parse_arena(const char *filename, const char *string, mpc_arena_t *a, mpc_parser_t *p, mpc_result_t *r);
+
+void *mpc_malloc(size_t n);
+void *mpc_calloc(size_t n, size_t m);
+void *mpc_realloc(void *p, size_t n);
+void mpc_free(void *p);
+
+/*
+** Events
+*/
+
+typedef struct {
+  void (*enter)(void *d, const char *rule, mpc_state_t s);
+  void (*leave)(void *d, const char *rule, mpc_state_t s);
+  void (*token)(void *d, const char *tag, const char *contents, int length, mpc_state_t s);
+} mpc_events_t;
+
+int mpc_parse_events(const char *filename, const char *string, mpc_parser_t *p, const mpc_events_t *e, void *d, mpc_result_t *r);
+
+/*
+** Incremental Parsing
+*/
+
+enum {
+  MPC_PARSE_ERROR = 0,
+  MPC_PARSE_DONE  = 1,
+  MPC_PARSE_MORE  = 2
+};
+
+struct mpc_parse_ctx_t;
+typedef struct mpc_parse_ctx_t mpc_parse_ctx_t;
+
+mpc_parse_ctx_t *mpc_parse_ctx_new(const char *filename, mpc_parser_t *p);
+void mpc_parse_ctx_delete(mpc_parse_ctx_t *c);
+
+int mpc_parse_feed(mpc_parse_ctx_t *c, const char *data, int length, mpc_result_t *r);
+int mpc_parse_finish(mpc_parse_ctx_t *c, mpc_result_t *r);
+int mpc_parse_pending(mpc_parse_ctx_t *c);
+
+int mpc_parse_ctx_string(mpc_parse_ctx_t *c, const char *string, int length, mpc_result_t *r);
+void mpc_parse_ctx_trim(mpc_parse_ctx_t *c);
+
 /*
 ** Function Types
 */
 
 typedef void(*mpc_dtor_t)(mpc_val_t*);
 typedef mpc_val_t*(*mpc_ctor_t)(void);
+typedef mpc_val_t*(*mpc_copy_t)(mpc_val_t*);
 
 typedef mpc_val_t*(*mpc_apply_t)(mpc_val_t*);
 typedef mpc_val_t*(*mpc_apply_to_t)(mpc_val_t*,void*);
 typedef mpc_val_t*(*mpc_fold_t)(int,mpc_val_t**);
 
+/*
+** Parallel Parsing
+*/
+
+int mpc_parse_parallel(const char *filename, const char *string, int length, const char *brackets,
+  int threads, mpc_parser_t *p, mpc_fold_t f, mpc_dtor_t d, mpc_result_t *r);
+
 /*
 ** Building a Parser
 */
@@ -109,6 +174,7 @@ mpc_parser_t *mpc_lift(mpc_ctor_t f);
 mpc_parser_t *mpc_lift_val(mpc_val_t *x);
 mpc_parser_t *mpc_anchor(int(*f)(char,char));
 mpc_parser_t *mpc_state(void);
+mpc_parser_t *mpc_cut(void);
 
 /*
 ** Combinator Parsers
@@ -132,6 +198,10 @@ mpc_parser_t *mpc_or(int n, ...);
 mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_copy_t cp, mpc_dtor_t da);
+
+mpc_parser_t *mpc_compile(mpc_parser_t *a);
+void mpc_optimise(mpc_parser_t *p);
 
 /*
 ** Common Parsers
@@ -246,6 +316,22 @@ mpc_val_t *mpcf_maths(int n, mpc_val_t** xs);
 */
 
 mpc_parser_t *mpc_re(const char *re);
+
+void mpc_re_cache_warm(int n, ...);
+void mpc_re_cache_clear(void);
+
+typedef struct {
+  int lazy;
+  int states;
+  int states_max;
+  long hits;
+  long misses;
+  long flushes;
+  long fallbacks;
+} mpc_re_stats_t;
+
+void mpc_re_dfa_budget(size_t bytes);
+int mpc_re_stats(const char *re, mpc_re_stats_t *s);
   
 /*
 ** AST
@@ -257,10 +343,13 @@ typedef struct mpc_ast_t {
   mpc_state_t state;
   int children_num;
   struct mpc_ast_t** children;
+  int refs;
 } mpc_ast_t;
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...);
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
+mpc_ast_t *mpc_ast_retain(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t);
@@ -295,10 +384,28 @@ mpc_parser_t *mpca_count(int n, mpc_parser_t *a);
 mpc_parser_t *mpca_or(int n, ...);
 mpc_parser_t *mpca_and(int n, ...);
 
+/*
+** Note: Each edit's `pos` is a byte offset into the old input the tree `a` was
+** parsed from, and `removed` and `added` are byte counts. On success `a` is
+** taken: it is either updated in place and returned in `r->output` or deleted
+** after a full parse. On failure `a` is untouched and still the caller's.
+*/
+
+typedef struct {
+  int pos;
+  int removed;
+  int added;
+} mpc_edit_t;
+
+int mpca_reparse(const char *filename, const char *string, mpc_ast_t *a,
+  const mpc_edit_t *es, int n, mpc_parser_t *p, mpc_result_t *r);
+
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_PACKRAT              = 4,
+  MPCA_LANG_NO_OPTIMISE          = 8
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -314,6 +421,9 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
 void mpc_print(mpc_parser_t *p);
 
+void mpc_profile_print(mpc_parser_t *p);
+void mpc_profile_clear(mpc_parser_t *p);
+
 int mpc_test_pass(mpc_parser_t *p, const char *s, void *d,
   int(*tester)(void*, void*), 
   mpc_dtor_t destructor, 